@@ -0,0 +1,128 @@
+/*
+Copyright 2016 Stepper 3 LLC
+Copyright 2016 Eric Alzheimer
+
+Licensed under the GNU GPL version 3.0 license:
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <https://www.gnu.org/licenses/>.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/************************************************************
+ * linux_stats.c
+ * --------------------------------------------------------
+ *  Renders a typical FTUI screen against the linux platform
+ *  (fthw_platform_linux.c) and prints what each frame cost on the
+ *  emulated SPI bus. Use it to compare config options or FTGL changes
+ *  without a board.
+ *
+ *  Build and run from the repository root:
+ *
+ *    gcc -std=c99 -O2 -I. extras/linux_stats.c ftgl.c ftui.c \
+ *        fthw_platform_linux.c -lpthread -o linux_stats
+ *    ./linux_stats [frames]
+ *
+ *  The screen has a status region that changes every 30 frames, a clock
+ *  region that refreshes every second, and a keypad, gauge and slider
+ *  that are drawn every frame. A touch on the first key is simulated
+ *  part way through.
+ ***********************************************************/
+#include "ftui.h"
+#include "ftgl.h"
+#include "fthw.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define REGION_STATUS 0
+#define REGION_CLOCK  1
+
+#define DEFAULT_FRAMES 120
+
+static void DrawScreen(int frame) {
+    int32_t temperature = 200 + frame / 30;
+    int32_t seconds = FTUIGetTicks() / 1000;
+
+    FTUIBegin();
+
+    if (FTUIRegionBegin(REGION_STATUS, FTUI_REFRESH_ON_CHANGE, (uint32_t)temperature)) {
+        FTUIBackgroundRect(0, 0, 480, 40, 0x202020);
+        FTUIText(10, 8, 28, 0, "Temperature");
+        FTUINumber(160, 8, 28, 0, temperature);
+        FTUIText(240, 8, 28, 0, "Setpoint");
+        FTUINumber(360, 8, 28, 0, 210);
+    }
+    FTUIRegionEnd();
+
+    if (FTUIRegionBegin(REGION_CLOCK, FTUI_REFRESH_PERIODIC, 1000)) {
+        FTUILargeNumber(16, 60, 4, 2, 1, seconds);
+    }
+    FTUIRegionEnd();
+
+    FTUIKeyRows(1, 224, 56, 240, 50, 28, 3, "789\000456\000123\000\000");
+    FTUIButton(2, 224, 218, 118, 50, 28, "0");
+    FTUIButton(3, 346, 218, 118, 50, 28, "Enter");
+    FTGLCmdGauge(100, 190, 60, 0, 4, 2, (uint16_t)(frame % 100), 100);
+    FTGLCmdSlider(16, 258, 180, 8, 0, (uint16_t)(frame % 100), 100);
+
+    FTUIEnd();
+}
+
+int main(int argc, char **argv) {
+    FTHWLinuxStats stats, total = { 0 };
+    int frames = DEFAULT_FRAMES;
+    int frame;
+
+    if (argc > 1) { frames = atoi(argv[1]); }
+
+    FTUIInitialize();
+
+    printf("frame transactions reads writes    bytes  payload  bus_us\n");
+    for (frame = 0; frame < frames; frame++) {
+        if (frame == frames / 2) {
+            FTHWLinuxSetTouch(250, 80, 1);
+        } else if (frame == frames / 2 + 5) {
+            FTHWLinuxSetTouch(-1, -1, 0);
+        }
+
+        FTHWLinuxResetStats();
+        DrawScreen(frame);
+        FTHWLinuxGetStats(&stats);
+
+        printf("%5d %12lu %5lu %6lu %8lu %8lu %7lu\n", frame,
+               (unsigned long)stats.transactions, (unsigned long)stats.reads,
+               (unsigned long)stats.writes, (unsigned long)stats.bytes,
+               (unsigned long)stats.payloadBytes,
+               (unsigned long)(stats.busTimeNS / 1000));
+
+        total.transactions += stats.transactions;
+        total.bytes += stats.bytes;
+        total.busTimeNS += stats.busTimeNS;
+    }
+
+    if (frames > 0) {
+        printf("average: %lu transactions, %lu bytes, %lu us per frame\n",
+               (unsigned long)(total.transactions / frames),
+               (unsigned long)(total.bytes / frames),
+               (unsigned long)(total.busTimeNS / 1000 / frames));
+    }
+    return 0;
+}
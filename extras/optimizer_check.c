@@ -0,0 +1,558 @@
+/*
+Copyright 2016 Stepper 3 LLC
+Copyright 2016 Eric Alzheimer
+
+Licensed under the GNU GPL version 3.0 license:
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <https://www.gnu.org/licenses/>.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/************************************************************
+ * optimizer_check.c
+ * --------------------------------------------------------
+ *  Checks FTGLOptimizeCommands against the linux platform's
+ *  emulated coprocessor (fthw_platform_linux.c).
+ *
+ *  Each command stream is run through the emulator twice, as it is and
+ *  after optimizing it, and the two display lists left in RAM_DL are
+ *  interpreted. The optimized one is shorter, so they are not compared
+ *  word for word. Instead, every draw that can reach the screen (each
+ *  vertex, pair of vertices, CLEAR, widget or other command) has to come
+ *  out in the same order with the same graphics state, and the state
+ *  left at the end has to match.
+ *
+ *  The streams are the display lists FTGL records for a few FTUI frames,
+ *  and randomly generated streams that mix display list and coprocessor
+ *  commands, with plenty of redundant state and off screen draws.
+ *
+ *  Build and run from the repository root:
+ *
+ *    gcc -std=c99 -O2 -I. extras/optimizer_check.c ftgl.c ftui.c \
+ *        fthw_platform_linux.c -lpthread -o optimizer_check
+ *    ./optimizer_check [streams] [seed]
+ *
+ *  Exits with 1 if any stream changed what it draws.
+ ***********************************************************/
+#include "ftui.h"
+#include "ftgl.h"
+#include "fthw.h"
+#include "FT800.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_STREAMS  2000
+#define MAX_STREAM_SIZE  16384
+#define MAX_COMMANDS     250
+#define MAX_EVENTS       4096
+#define NUM_STATE_OPS    0x21
+#define CONTEXT_DEPTH    4
+
+typedef struct {
+    uint8_t data[MAX_STREAM_SIZE];
+    uint32_t size;
+} Stream;
+
+// The display list state, as the words that last set each part of it
+typedef struct {
+    uint32_t value[NUM_STATE_OPS];
+    uint32_t bitmap[32][3]; // BITMAP_SOURCE, LAYOUT and SIZE of each handle
+} GraphicsState;
+
+// What a display list draws, as a hash per draw
+typedef struct {
+    GraphicsState state;
+    GraphicsState saved[CONTEXT_DEPTH];
+    uint8_t depth;
+    uint32_t primitive;
+    uint32_t previous;      // First vertex of a pair, or the last strip vertex
+    uint8_t hasPrevious;
+    uint64_t previousState; // State when the first vertex of a pair was drawn
+    uint64_t events[MAX_EVENTS];
+    uint32_t eventCount;
+} Interpreter;
+
+static uint32_t s_Seed;
+static Stream s_Raw, s_Optimized;
+static uint32_t s_DisplayList[FT_RAM_DL_SIZE / 4];
+static Interpreter s_Before, s_After;
+
+static uint32_t Random(uint32_t n) {
+    s_Seed = s_Seed * 1103515245UL + 12345UL;
+    return (s_Seed >> 8) % n;
+}
+
+//////////////////////////////////////////////////////
+// Running streams on the emulator
+
+static uint32_t ReadReg(uint32_t addr) {
+    uint32_t val;
+    memcpy(&val, FTHWLinuxMemory(addr), sizeof(val));
+    return FT_TO_HOST_ULONG(val);
+}
+
+// Writes commands to the queue and lets the (instant) coprocessor take them
+static void Send(const uint8_t *data, uint32_t size) {
+    while (size > 0) {
+        uint32_t write = ReadReg(FT_REG_CMD_WRITE) & 0xFFF;
+        uint32_t chunk = FT_CMDFIFO_SIZE - write;
+        uint16_t index;
+        if (chunk > 2048) { chunk = 2048; }
+        if (chunk > size) { chunk = size; }
+        FTHWWrite(FT_RAM_CMD + write, data, (uint16_t)chunk);
+        index = HOST_TO_FT_USHORT((uint16_t)((write + chunk) & 0xFFF));
+        FTHWWrite(FT_REG_CMD_WRITE, (const uint8_t*)&index, sizeof(index));
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+// Runs the commands from a fresh display list, and returns the number of
+// words the coprocessor left in RAM_DL
+static uint32_t Run(const uint8_t *commands, uint32_t size) {
+    uint32_t dlstart = HOST_TO_FT_ULONG(FT_CMD_DLSTART), words, i;
+    Send((const uint8_t*)&dlstart, sizeof(dlstart));
+    Send(commands, size);
+    words = ReadReg(FT_REG_CMD_DL) / 4;
+    memcpy(s_DisplayList, FTHWLinuxMemory(FT_RAM_DL), words * 4);
+    for (i = 0; i < words; i++) {
+        s_DisplayList[i] = FT_TO_HOST_ULONG(s_DisplayList[i]);
+    }
+    return words;
+}
+
+//////////////////////////////////////////////////////
+// Interpreting display lists
+
+static uint64_t Hash(uint64_t hash, uint32_t val) {
+    uint8_t i;
+    for (i = 0; i < 4; i++) {
+        hash ^= (val >> (i * 8)) & 0xFF;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t HashState(const GraphicsState *state, int withBitmaps) {
+    uint64_t hash = 14695981039346656037ULL;
+    uint32_t i;
+    for (i = 0; i < NUM_STATE_OPS; i++) { hash = Hash(hash, state->value[i]); }
+    if (withBitmaps) {
+        for (i = 0; i < 32; i++) {
+            hash = Hash(hash, state->bitmap[i][0]);
+            hash = Hash(hash, state->bitmap[i][1]);
+            hash = Hash(hash, state->bitmap[i][2]);
+        }
+    }
+    return hash;
+}
+
+static void AddEvent(Interpreter *in, uint64_t hash) {
+    if (in->eventCount < MAX_EVENTS) { in->events[in->eventCount] = hash; }
+    in->eventCount++;
+}
+
+// The power on graphics state, from the FT800 programmers guide
+static void ResetInterpreter(Interpreter *in) {
+    uint32_t *v = in->state.value;
+    memset(in, 0, sizeof(*in));
+    v[0x02] = FT_CLEAR_COLOR_RGB(0, 0, 0);
+    v[0x03] = FT_TAG(255);
+    v[0x04] = FT_COLOR_RGB(255, 255, 255);
+    v[0x05] = FT_BITMAP_HANDLE(0);
+    v[0x06] = FT_CELL(0);
+    v[0x09] = FT_ALPHA_FUNC(FT_ALWAYS, 0);
+    v[0x0A] = FT_STENCIL_FUNC(FT_ALWAYS, 0, 255);
+    v[0x0B] = FT_BLEND_FUNC(FT_SRC_ALPHA, FT_ONE_MINUS_SRC_ALPHA);
+    v[0x0C] = FT_STENCIL_OP(FT_KEEP, FT_KEEP);
+    v[0x0D] = FT_POINT_SIZE(16);
+    v[0x0E] = FT_LINE_WIDTH(16);
+    v[0x0F] = FT_CLEAR_COLOR_A(0);
+    v[0x10] = FT_COLOR_A(255);
+    v[0x11] = FT_CLEAR_STENCIL(0);
+    v[0x12] = FT_CLEAR_TAG(0);
+    v[0x13] = FT_STENCIL_MASK(255);
+    v[0x14] = FT_TAG_MASK(1);
+    v[0x15] = FT_BITMAP_TRANSFORM_A(256);
+    v[0x16] = FT_BITMAP_TRANSFORM_B(0);
+    v[0x17] = FT_BITMAP_TRANSFORM_C(0);
+    v[0x18] = FT_BITMAP_TRANSFORM_D(0);
+    v[0x19] = FT_BITMAP_TRANSFORM_E(256);
+    v[0x1A] = FT_BITMAP_TRANSFORM_F(0);
+    v[0x1B] = FT_SCISSOR_XY(0, 0);
+    v[0x1C] = FT_SCISSOR_SIZE(512, 512);
+    v[0x20] = FT_COLOR_MASK(1, 1, 1, 1);
+}
+
+static int32_t FloorDiv16(int32_t v) {
+    return v >= 0 ? v / 16 : -((-v + 15) / 16);
+}
+
+// The pixels a vertex can touch, right and bottom exclusive. Points and
+// lines get half a pixel of antialiasing past their radius.
+static void VertexBox(const Interpreter *in, uint32_t w, int32_t box[4]) {
+    uint8_t prim = (uint8_t)(in->primitive & 0xF);
+    int32_t x16, y16, r16;
+    uint8_t handle;
+
+    if ((w >> 30) == 1) {
+        x16 = (int32_t)((w >> 15) & 0x7FFF);
+        y16 = (int32_t)(w & 0x7FFF);
+        if (x16 & 0x4000) { x16 -= 0x8000; }
+        if (y16 & 0x4000) { y16 -= 0x8000; }
+        handle = (uint8_t)(in->state.value[0x05] & 31);
+    } else {
+        x16 = (int32_t)((w >> 21) & 511) * 16;
+        y16 = (int32_t)((w >> 12) & 511) * 16;
+        handle = (uint8_t)((w >> 7) & 31);
+    }
+
+    if (prim == FT_BITMAPS) {
+        uint32_t size = in->state.bitmap[handle][2];
+        int32_t width = (int32_t)((size >> 9) & 511), height = (int32_t)(size & 511);
+        box[0] = FloorDiv16(x16);
+        box[1] = FloorDiv16(y16);
+        box[2] = box[0] + (width ? width : 512);
+        box[3] = box[1] + (height ? height : 512);
+        return;
+    }
+
+    r16 = prim == FT_POINTS ? (int32_t)(in->state.value[0x0D] & 8191)
+                            : (int32_t)(in->state.value[0x0E] & 4095);
+    box[0] = FloorDiv16(x16 - r16 - 8);
+    box[1] = FloorDiv16(y16 - r16 - 8);
+    box[2] = FloorDiv16(x16 + r16 + 8) + 1;
+    box[3] = FloorDiv16(y16 + r16 + 8) + 1;
+}
+
+static int Visible(const Interpreter *in, const int32_t box[4]) {
+    uint32_t xy = in->state.value[0x1B], size = in->state.value[0x1C];
+    int32_t x = (int32_t)((xy >> 9) & 511), y = (int32_t)(xy & 511);
+    int32_t w = (int32_t)((size >> 10) & 1023), h = (int32_t)(size & 1023);
+    return box[0] < x + w && box[2] > x && box[1] < y + h && box[3] > y;
+}
+
+static void Vertex(Interpreter *in, uint32_t w) {
+    uint8_t prim = (uint8_t)(in->primitive & 0xF);
+    uint8_t handle = (w >> 30) == 1 ? (uint8_t)(in->state.value[0x05] & 31) : (uint8_t)((w >> 7) & 31);
+    uint64_t state = HashState(&in->state, 0);
+    int32_t box[4];
+
+    if (prim == FT_BITMAPS) {
+        state = Hash(Hash(Hash(state, in->state.bitmap[handle][0]),
+                          in->state.bitmap[handle][1]), in->state.bitmap[handle][2]);
+    }
+
+    if (prim == FT_POINTS || prim == FT_BITMAPS) {
+        VertexBox(in, w, box);
+        if (Visible(in, box)) { AddEvent(in, Hash(Hash(state, in->primitive), w)); }
+    } else if (prim == FT_LINES || prim == FT_RECTS) {
+        if (!in->hasPrevious) {
+            in->previous = w;
+            in->previousState = state;
+            in->hasPrevious = 1;
+        } else {
+            int32_t first[4];
+            VertexBox(in, in->previous, first);
+            VertexBox(in, w, box);
+            if (first[0] < box[0]) { box[0] = first[0]; }
+            if (first[1] < box[1]) { box[1] = first[1]; }
+            if (first[2] > box[2]) { box[2] = first[2]; }
+            if (first[3] > box[3]) { box[3] = first[3]; }
+            if (Visible(in, box)) {
+                uint64_t hash = Hash(Hash(state, in->primitive), in->previous);
+                AddEvent(in, Hash(Hash(hash, w), (uint32_t)in->previousState));
+            }
+            in->hasPrevious = 0;
+        }
+    } else {
+        // Strips are drawn from the vertex before, so that is part of the draw
+        uint64_t hash = Hash(Hash(state, in->primitive), w);
+        AddEvent(in, Hash(hash, in->hasPrevious ? in->previous : 0xFFFFFFFFUL));
+        in->previous = w;
+        in->hasPrevious = 1;
+    }
+}
+
+static int StateOp(uint8_t op) {
+    return (op >= 0x02 && op <= 0x06) || (op >= 0x09 && op <= 0x1C) || op == 0x20;
+}
+
+static void Interpret(Interpreter *in, const uint32_t *dl, uint32_t words) {
+    uint32_t i;
+    ResetInterpreter(in);
+    for (i = 0; i < words; i++) {
+        uint32_t w = dl[i];
+        uint8_t op = (uint8_t)(w >> 24);
+
+        if ((w >> 30) != 0) {
+            Vertex(in, w);
+        } else if (StateOp(op)) {
+            in->state.value[op] = w;
+        } else if (op == 0x01 || op == 0x07 || op == 0x08) {
+            uint8_t handle = (uint8_t)(in->state.value[0x05] & 31);
+            in->state.bitmap[handle][op == 0x01 ? 0 : op == 0x07 ? 1 : 2] = w;
+        } else if (op == 0x1F) { // BEGIN
+            in->primitive = w;
+            in->hasPrevious = 0;
+        } else if (op == 0x21) {
+            // END does nothing, the programmers guide allows leaving it out
+        } else if (op == 0x22) { // SAVE_CONTEXT
+            if (in->depth < CONTEXT_DEPTH) {
+                memcpy(in->saved[in->depth++].value, in->state.value, sizeof(in->state.value));
+            }
+        } else if (op == 0x23) { // RESTORE_CONTEXT
+            if (in->depth > 0) {
+                memcpy(in->state.value, in->saved[--in->depth].value, sizeof(in->state.value));
+            }
+        } else {
+            // CLEAR, DISPLAY, widgets (NOPs in the emulator), CALL, MACRO...
+            AddEvent(in, Hash(HashState(&in->state, 0), w));
+        }
+    }
+    // Whatever comes after the stream sees the state it leaves behind
+    AddEvent(in, Hash(HashState(&in->state, 1), in->primitive));
+}
+
+//////////////////////////////////////////////////////
+// Streams
+
+static void Put32(Stream *s, uint32_t w) {
+    s->data[s->size++] = (uint8_t)w;
+    s->data[s->size++] = (uint8_t)(w >> 8);
+    s->data[s->size++] = (uint8_t)(w >> 16);
+    s->data[s->size++] = (uint8_t)(w >> 24);
+}
+
+static void PutString(Stream *s, const char *str, uint32_t len) {
+    memcpy(s->data + s->size, str, len);
+    memset(s->data + s->size + len, 0, 4 - (len & 3));
+    s->size += (len + 4) & ~3UL;
+}
+
+static uint32_t RandomVertex(void) {
+    if (Random(2)) {
+        int32_t x = (int32_t)Random(900 * 16) - 200 * 16;
+        int32_t y = (int32_t)Random(600 * 16) - 200 * 16;
+        return FT_VERTEX2F(x, y);
+    }
+    return FT_VERTEX2II(Random(512), Random(512), Random(4), Random(3));
+}
+
+static uint32_t RandomState(void) {
+    static const uint16_t scissor[3][4] = {
+        { 0, 0, 512, 512 }, { 100, 50, 120, 80 }, { 300, 200, 100, 60 }
+    };
+    uint32_t pick = Random(3);
+    switch (Random(14)) {
+    case 0: return FT_COLOR_RGB(pick * 100, 255, 0);
+    case 1: return FT_COLOR_A(pick ? 255 : 128);
+    case 2: return FT_POINT_SIZE(16 + pick * 100);
+    case 3: return FT_LINE_WIDTH(16 + pick * 40);
+    case 4: return FT_BITMAP_HANDLE(pick);
+    case 5: return FT_CELL(pick);
+    case 6: return FT_SCISSOR_XY(scissor[pick][0], scissor[pick][1]);
+    case 7: return FT_SCISSOR_SIZE(scissor[pick][2], scissor[pick][3]);
+    case 8: return FT_TAG(pick + 1);
+    case 9: return FT_BLEND_FUNC(FT_SRC_ALPHA, pick ? FT_ONE : FT_ONE_MINUS_SRC_ALPHA);
+    case 10: return FT_BITMAP_TRANSFORM_A(pick ? 256 : 128);
+    case 11: return FT_BITMAP_TRANSFORM_E(pick ? 256 : 512);
+    case 12: return FT_CLEAR_COLOR_RGB(pick, 0, 0);
+    default: return FT_COLOR_MASK(1, 1, 1, pick != 0);
+    }
+}
+
+static void RandomCommand(Stream *s, uint8_t *depth) {
+    uint32_t kind = Random(100);
+    if (kind < 30) {
+        Put32(s, RandomVertex());
+    } else if (kind < 62) {
+        Put32(s, RandomState());
+    } else if (kind < 67) {
+        uint32_t pick = Random(3);
+        switch (Random(3)) {
+        case 0: Put32(s, FT_BITMAP_SOURCE(pick * 4096)); break;
+        case 1: Put32(s, FT_BITMAP_LAYOUT(FT_ARGB4, 40 + pick * 40, 20 + pick * 10)); break;
+        default: Put32(s, FT_BITMAP_SIZE(FT_NEAREST, FT_BORDER, FT_BORDER, pick * 20, pick * 30)); break;
+        }
+    } else if (kind < 78) {
+        Put32(s, FT_BEGIN(1 + Random(9)));
+    } else if (kind < 85) {
+        Put32(s, FT_END());
+    } else if (kind < 88) {
+        if (Random(2) && *depth < CONTEXT_DEPTH) {
+            Put32(s, FT_SAVE_CONTEXT());
+            (*depth)++;
+        } else if (*depth > 0) {
+            Put32(s, FT_RESTORE_CONTEXT());
+            (*depth)--;
+        }
+    } else if (kind < 90) {
+        Put32(s, FT_CLEAR(1, Random(2), 1));
+    } else {
+        // Coprocessor commands, some of them holding words that look like
+        // the optimizer's removed command marker
+        switch (Random(5)) {
+        case 0:
+            Put32(s, FT_CMD_FGCOLOR);
+            Put32(s, 0x00FF00);
+            break;
+        case 1:
+            Put32(s, FT_CMD_LOADIDENTITY);
+            break;
+        case 2:
+            Put32(s, FT_CMD_TEXT);
+            Put32(s, (Random(272) << 16) | Random(480));
+            Put32(s, 28);
+            if (Random(2)) { PutString(s, "\xFF\xFF\xFF\xFF", 4); }
+            else { PutString(s, "Hello", 5); }
+            break;
+        case 3: {
+            uint32_t n = 4 * (1 + Random(4)), i;
+            Put32(s, FT_CMD_MEMWRITE);
+            Put32(s, FT_RAM_G + 65536);
+            Put32(s, n);
+            for (i = 0; i < n; i += 4) { Put32(s, Random(2) ? 0xFFFFFFFFUL : FT_END()); }
+            break;
+        }
+        default:
+            Put32(s, FT_CMD_GAUGE);
+            Put32(s, (120UL << 16) | 100);
+            Put32(s, 50);
+            Put32(s, (2UL << 16) | 4);
+            Put32(s, (100UL << 16) | 30);
+            break;
+        }
+    }
+}
+
+static void RandomStream(Stream *s) {
+    uint32_t count = 1 + Random(MAX_COMMANDS), i;
+    uint8_t depth = 0;
+    s->size = 0;
+    if (Random(2)) { Put32(s, FT_CMD_DLSTART); }
+    for (i = 0; i < count; i++) { RandomCommand(s, &depth); }
+}
+
+// Optimizes a copy of s_Raw into s_Optimized, runs both, and compares what
+// they draw. Returns false if they differ.
+static int Check(const char *name) {
+    uint32_t words, i;
+
+    memcpy(s_Optimized.data, s_Raw.data, s_Raw.size);
+    s_Optimized.size = FTGLOptimizeCommands(s_Optimized.data, s_Raw.size);
+
+    words = Run(s_Raw.data, s_Raw.size);
+    Interpret(&s_Before, s_DisplayList, words);
+    words = Run(s_Optimized.data, s_Optimized.size);
+    Interpret(&s_After, s_DisplayList, words);
+
+    if (s_Before.eventCount > MAX_EVENTS) {
+        printf("%s: too many draws to compare\n", name);
+        return 0;
+    }
+    for (i = 0; i < s_Before.eventCount && i < s_After.eventCount; i++) {
+        if (s_Before.events[i] != s_After.events[i]) { break; }
+    }
+    if (i < s_Before.eventCount || i < s_After.eventCount) {
+        printf("%s: FAILED, %lu -> %lu bytes, draws differ from draw %lu (%lu before, %lu after)\n",
+               name, (unsigned long)s_Raw.size, (unsigned long)s_Optimized.size,
+               (unsigned long)i, (unsigned long)s_Before.eventCount,
+               (unsigned long)s_After.eventCount);
+        return 0;
+    }
+    return 1;
+}
+
+//////////////////////////////////////////////////////
+// Recorded streams
+
+// Draws a few FTUI frames and takes the display list each one left in
+// RAM_DL, which is what FTGLEndRecord would have copied for it
+static int CheckRecordedFrames(void) {
+    int frame, ok = 1;
+    for (frame = 0; frame < 3; frame++) {
+        char name[48];
+        uint32_t words, i;
+
+        FTUIBegin();
+        FTUIBackgroundRect(0, 0, 480, 40, 0x202020);
+        FTUIText(10, 8, 28, 0, "Temperature");
+        FTUINumber(160, 8, 28, 0, 200 + frame);
+        FTUILargeNumber(16, 60, 4, 2, 1, 1234 + frame);
+        FTUIKeyRows(1, 224, 56, 240, 50, 28, 3, "789\000456\000123\000\000");
+        FTUIButton(2, 224, 218, 118, 50, 28, "0");
+        FTGLColorRGB(0xFF0000);
+        FTGLLineWidth(32);
+        FTGLBegin(FT_LINES);
+        FTGLVertex2ii(0, 270, 0, 0);
+        FTGLVertex2ii((uint16_t)(100 * frame), 270, 0, 0);
+        FTGLEnd();
+        FTUIEnd();
+
+        words = ReadReg(FT_REG_CMD_DL) / 4;
+        s_Raw.size = 0;
+        for (i = 0; i < words; i++) {
+            uint32_t w;
+            memcpy(&w, FTHWLinuxMemory(FT_RAM_DL + i * 4), sizeof(w));
+            Put32(&s_Raw, FT_TO_HOST_ULONG(w));
+        }
+
+        sprintf(name, "ftui frame %d", frame);
+        if (Check(name)) {
+            printf("%s: %lu -> %lu bytes\n", name,
+                   (unsigned long)s_Raw.size, (unsigned long)s_Optimized.size);
+        } else {
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    uint32_t streams = DEFAULT_STREAMS, n, failures = 0;
+    uint64_t rawBytes = 0, optimizedBytes = 0;
+
+    s_Seed = 1;
+    if (argc > 1) { streams = (uint32_t)strtoul(argv[1], NULL, 0); }
+    if (argc > 2) { s_Seed = (uint32_t)strtoul(argv[2], NULL, 0); }
+
+    FTUIInitialize();
+    if (!CheckRecordedFrames()) { failures++; }
+
+    // FTGL's queue indices are stale from here on, only Send is used
+    for (n = 0; n < streams; n++) {
+        char name[48];
+        uint32_t seed = s_Seed;
+        RandomStream(&s_Raw);
+        sprintf(name, "stream %lu (seed %lu)", (unsigned long)n, (unsigned long)seed);
+        if (!Check(name)) { failures++; }
+        rawBytes += s_Raw.size;
+        optimizedBytes += s_Optimized.size;
+    }
+
+    printf("%lu random streams: %llu -> %llu bytes, %lu failed\n",
+           (unsigned long)streams, (unsigned long long)rawBytes,
+           (unsigned long long)optimizedBytes, (unsigned long)failures);
+    return failures ? 1 : 0;
+}
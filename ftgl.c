@@ -34,6 +34,26 @@ SOFTWARE.
 #include "ftgl.h"
 #include <string.h>
 
+#if defined(ARDUINO) && defined(__AVR__)
+#   include <avr/pgmspace.h>
+#   define SINE_TABLE(i) ((int32_t)pgm_read_word_near(sineTable + (i)))
+#else
+#   ifndef PROGMEM
+#       define PROGMEM
+#   endif
+#   define SINE_TABLE(i) ((int32_t)sineTable[i])
+#endif
+
+#if FTGL_USE_SIMD == 1 && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#   if defined(__SSE2__)
+#       include <emmintrin.h>
+#       define VERTEX_SSE2
+#   elif defined(__ARM_NEON)
+#       include <arm_neon.h>
+#       define VERTEX_NEON
+#   endif
+#endif
+
 // To get some extra logging info on Arduino, and a slow
 // step by step initialization, uncomment this, and
 // rename the file to have a *.cpp extension so that
@@ -65,6 +85,35 @@ SOFTWARE.
 #define FTGL_CMD_QUEUE_SIZE 4092
 #define FTGL_QUEUE_MASK 0xFFF
 
+// How long to sleep on the interrupt pin before checking the command queue
+// again anyway, in case an interrupt was missed.
+#define FTGL_INTERRUPT_TIMEOUT_MS 10
+
+// Waiting for space in the command queue sleeps on the interrupt pin when
+// more than this many bytes have to be freed, and polls otherwise
+#define FTGL_SPACE_SLEEP_SHORTFALL (FTGL_CMD_QUEUE_SIZE / 2)
+
+// How long to wait for a display list swap before giving up on it. A swap
+// takes at most one display frame, but never happens if the display is not
+// clocked or the FT800 has been reset.
+#define FTGL_SWAP_TIMEOUT_MS 100
+
+// Payloads bigger than the command queue are written in pieces of this size
+#define FTGL_PAYLOAD_CHUNK_SIZE 1024
+
+// Payloads from a reader are read into a buffer on the stack of this size
+#define FTGL_STREAM_CHUNK_SIZE 128
+
+// Snapshot registers this many bytes apart or less are read in the same
+// transfer, since the unused bytes cost less than a new address and dummy
+// byte. Transfers are limited to FTGL_SNAPSHOT_MAX_BURST bytes.
+#define FTGL_SNAPSHOT_MAX_GAP 8
+#define FTGL_SNAPSHOT_MAX_BURST 64
+
+// Snapshot slots used by FTGL itself
+#define SNAPSHOT_TOUCH_SCREEN_XY 0
+#define SNAPSHOT_TOUCH_TAG 1
+
 typedef enum {
     BMP_TRANSFORM_A,
     BMP_TRANSFORM_B,
@@ -91,9 +140,10 @@ typedef struct {
     uint32_t scissorXY;
     uint32_t bitmapHandle;
 
-    // We do not cache the bitmap transform, since it can get changed by
-    // the CMD_SETMATRIX command, and it is computationally expensive to
-    // determine what it changed things to.
+    // Indexed by BitmapTransformIndex. CMD_SETMATRIX writes these from the
+    // coprocessor matrix, so they become unknown then unless the matrix is
+    // known to be the identity.
+    uint32_t bitmapTransform[6];
 
     uint32_t clearStencil;
     uint32_t clearTag;
@@ -102,6 +152,12 @@ typedef struct {
     uint32_t tagMask;
     uint32_t clearColorAlpha;
     uint32_t clearColorRGB;
+    uint32_t colorMask;
+
+    // The primitive of the last BEGIN. This is not part of the FT800's
+    // graphics context, so SAVE_CONTEXT and RESTORE_CONTEXT do not change it,
+    // but coprocessor widgets do.
+    uint32_t primitive;
 } GraphicsContext;
 
 typedef struct {
@@ -118,15 +174,29 @@ typedef struct {
     // so there will not be a large number of calls to it. As such, it is not
     // cached
 
-    // The coprocessor stores a transform matrix, but all of the operations on
-    // it are transforms applied to the current values, 
-    // so caching it here does not eliminate any operations.
+    // The coprocessor stores a transform matrix. All of the operations on it
+    // are applied to the current values, so the only thing tracked is
+    // whether it is the identity, which is what CMD_SETMATRIX would then
+    // write to the bitmap transform.
+    uint8_t matrixIdentity;
 
     // The coprocessor stores a bitmap handle, but you have to provide it in
     // every call that uses it, so there is no use caching it.
     // uint8_t cmdBitmapHandle;
 } CoprocessorContext;
 
+// A clip rectangle, with right and bottom exclusive
+typedef struct {
+    int16_t x0, y0, x1, y1;
+} ClipRect;
+
+// The inverse of the host matrix, in 16.16 fixed point. This maps screen
+// pixels back to bitmap pixels, the way the bitmap transform does.
+typedef struct {
+    int32_t a, b, c;
+    int32_t d, e, f;
+} HostMatrix;
+
 typedef struct {
     uint32_t bitmapAddress;
     uint32_t bitmapDataSize;
@@ -140,18 +210,163 @@ typedef struct {
     // it.
     int8_t activeHandle;
 
+    // True if this id is in use
+    uint8_t allocated;
+
+    // True if the handle this bitmap is loaded into is never evicted
+    uint8_t pinned;
+
+    // True if this bitmap is a layer holding an up to date snapshot
+    uint8_t layerValid;
+
 } BitmapInfo;
 
+typedef struct {
+    // Where the recording is stored in RAM_G
+    uint32_t address;
+
+    // The space allocated for the recording, and how much of it is used. A
+    // size of zero means that nothing has been recorded.
+    uint32_t capacity;
+    uint32_t size;
+} Segment;
+
+// An allocated block of RAM_G, and what it belongs to, so that its owner can
+// be updated if the block is moved.
+typedef struct {
+    uint32_t address;
+    uint32_t size;
+    uint8_t ownerType;
+    int16_t ownerId;
+} RamBlock;
+
+#define RAM_OWNER_BITMAP  0
+#define RAM_OWNER_SEGMENT 1
+
+// Every block belongs to a bitmap or a segment, so this many is always enough
+#define FTGL_RAM_BLOCKS (FTGL_MAX_BITMAPS + FTGL_MAX_SEGMENTS)
+
+#define FTGL_RAM_NONE 0xFFFFFFFFUL
+
+#if FTGL_DEFERRED_DRAWS > 0
+// The state a deferred draw depends on, as it was when the draw was made.
+// The first three are display list commands, as in GraphicsContext.
+typedef struct {
+    uint32_t colorRGB;
+    uint32_t colorAlpha;
+    uint32_t tag;
+    uint32_t fgColor;
+    uint32_t gradColor;
+} DeferredState;
+
+#define DEFER_BITMAP 0
+#define DEFER_TEXT   1
+#define DEFER_NUMBER 2
+#define DEFER_BUTTON 3
+
+typedef struct {
+    DeferredState state;
+    int16_t x, y, w, h;     // w and h are only used by buttons
+    int16_t font;           // The bitmap id for bitmaps
+    uint16_t options;       // The cell for bitmaps
+    int32_t n;              // The value for numbers
+    uint16_t text, textLen; // Where the string is in deferredText
+    int16_t box[4];         // Left, top, right, bottom of what it may cover
+    uint8_t type;
+} DeferredDraw;
+#endif
+
 typedef struct {
     uint16_t cmdQueueReadIndex;
     uint16_t cmdQueueWriteIndex;
     uint16_t cmdQueueFreeSpace;
 
+    // The last value written to REG_CMD_WRITE
+    uint16_t publishedIndex;
+
+    // Where in the command queue the next byte sent to the FT800 goes. This
+    // is behind cmdQueueWriteIndex by whatever is in the write buffer.
+    uint16_t sendIndex;
+
+#if FTGL_ASYNC_TRANSFER == 0
+    // True if an append write to RAM_CMD is in progress
+    uint8_t appendOpen;
+#endif
+
+#if FTGL_FRAME_ELISION == 1
+    // True while none of the current frame has been published to
+    // REG_CMD_WRITE, so the frame can still be dropped.
+    uint8_t frameHeld;
+    #define FRAME_HELD() g_Inst.frameHeld
+
+    // Where the current frame starts in the command queue, and the running
+    // CRC of everything appended since, while frameHeld
+    uint16_t frameStart;
+    uint32_t frameCrc;
+
+    // The CRC of the last frame that was displayed, if lastFrameValid
+    uint32_t lastFrameCrc;
+    uint8_t lastFrameValid;
+#else
+    #define FRAME_HELD() 0
+#endif
+
+#if FTGL_WRITE_BUFFER_SIZE > 0
+    // Commands waiting to be sent as part of the current append write.
+    // cmdQueueWriteIndex already counts these bytes.
+    #if FTGL_ASYNC_TRANSFER == 1
+        // One buffer is filled while the other is being sent
+        uint8_t writeBuffers[2][FTGL_WRITE_BUFFER_SIZE];
+        uint8_t activeBuffer;
+        #define WRITE_BUFFER(inst) inst.writeBuffers[inst.activeBuffer]
+    #else
+        uint8_t writeBuffer[FTGL_WRITE_BUFFER_SIZE];
+        #define WRITE_BUFFER(inst) inst.writeBuffer
+    #endif
+    uint16_t writeBufferCount;
+#endif
+
+#if FTGL_USE_INTERRUPTS == 1
+    // True if the platform can wait on the interrupt pin
+    uint8_t interruptsAvailable;
+
+    // Reading REG_INT_FLAGS clears it, so every flag read is collected
+    // here until it is used.
+    uint8_t interruptFlags;
+
+    // The value of REG_INT_MASK
+    uint8_t interruptMask;
+#endif
+
+#if FTGL_ASYNC_TRANSFER == 1
+
+    // Tickets for the transfers sending each buffer, < 0 if not in flight.
+    int16_t bufferTickets[2];
+
+    // REG_CMD_WRITE is also written asynchronously, so its value has to
+    // stay around until the transfer is done.
+    uint16_t cmdWriteValue;
+    int16_t cmdWriteTicket;
+
+    // The most recently submitted transfer. Transfers complete in order,
+    // so once this one is done, all of them are.
+    int16_t lastTicket;
+
+    // True if a frame was submitted by FTGLSwapBuffers and has not been
+    // waited for yet.
+    uint8_t framePending;
+#endif
+
 #if FTGL_CACHE_GRAPHICS_CONTEXT == 1
 #define FTGL_CONTEXT_STACK_SIZE (1 + FTGL_CONTEXT_STACK_DEPTH)
     #if FTGL_CONTEXT_STACK_SIZE > 1
         GraphicsContext graphicsContext[FTGL_CONTEXT_STACK_SIZE];
         uint8_t contextStackIndex;
+        // A bit for each level of the stack that was saved with
+        // SAVE_CONTEXT, because some of its state was not known
+        uint16_t contextHardware;
+        // Saves deeper than the stack, which all use SAVE_CONTEXT
+        uint8_t contextOverflow;
         #define GRAPHICS_CONTEXT(inst) inst.graphicsContext[inst.contextStackIndex]
         #define GRAPHICS_CONTEXT_INDEX(inst, idx) inst.graphicsContext[idx]
     #else
@@ -159,40 +374,83 @@ typedef struct {
         #define GRAPHICS_CONTEXT(inst)            inst.graphicsContext
         #define GRAPHICS_CONTEXT_INDEX(inst, idx) inst.graphicsContext
     #endif
+
+    // Bitmap transform values that have been set but not sent yet, with a
+    // bit per BitmapTransformIndex. They are sent before the next command,
+    // so that a transform that is set and then set back before anything
+    // uses it is never sent at all.
+    uint32_t transformValues[6];
+    uint8_t transformPending;
 #endif
 
 
+    HostMatrix matrix[1 + FTGL_MATRIX_STACK_DEPTH];
+    uint8_t matrixIndex;
+
+#if FTGL_CLIP_STACK_DEPTH > 0
+    // The first entry is the scissor every display list starts with
+    ClipRect clipStack[1 + FTGL_CLIP_STACK_DEPTH];
+    uint8_t clipIndex;
+#endif
+
 #if FTGL_CACHE_COMMAND_CONTEXT == 1
     CoprocessorContext commandContext;
+#if FTGL_COMMAND_STACK_DEPTH > 0
+    CoprocessorContext commandStack[FTGL_COMMAND_STACK_DEPTH];
+    uint8_t commandStackIndex;
+#endif
 #endif
 
     BitmapInfo bitmaps[FTGL_MAX_BITMAPS];
 
-    // Next available bitmap struct
-    int16_t bitmapIndex;
-
 #if FTGL_CACHE_BITMAP_HANDLES == 1
     // Maps device bitmap handles to the bitmap currently loaded into them.
     // if < 0, no bitmap is loaded.
     // if >= 0, index the bitmaps array.
     int16_t bitmapHandles[FTGL_NUM_BITMAP_HANDLES];
 
-    // The last used handle. If all of the handles are taken, a bitmap must be
-    // evicted. We will evict the first bitmap handle we find that isn't
-    // lastHandle. This provides a semi-LRU behavior to the bitmap
-    // replacement, to at least eliminate the pathological case of alternating
-    // between two images.
-    int8_t lastHandle; 
-
-    // The next index to look at when we need to either grab an
-    // empty handle or evict a bitmap.
-    // The next index to look at is the one after the last
-    // one we used. 
-    int8_t nextHandle;
+    // When each handle was last used, as a count of handle uses. If all of
+    // the handles are taken, the least recently used one is evicted.
+    uint32_t handleLastUse[FTGL_NUM_BITMAP_HANDLES];
+    uint32_t handleUseCount;
+
+    // Bit masks of the handles loaded during the current frame, and the
+    // handles drawn during the current frame using a load from an earlier
+    // frame. The FT800 runs the whole display list for every line, so a
+    // handle reloaded later in the frame would change what the earlier
+    // draws show. Handles in handlesCarried are not evicted if possible.
+    uint16_t handlesLoaded;
+    uint16_t handlesCarried;
+
+    uint8_t pinnedCount;
+    FTGLBitmapHandleStats handleStats;
 #endif
 
-    // Next free space in graphics ram for allocating bitmaps
-    uint32_t graphicsRamIndex;
+    // The allocated blocks of RAM_G, sorted by address
+    RamBlock ramBlocks[FTGL_RAM_BLOCKS];
+    uint8_t ramBlockCount;
+
+    Segment segments[FTGL_MAX_SEGMENTS];
+    int16_t segmentCount;
+
+    // True between FTGLBeginBuffer and FTGLSwapBuffers
+    uint8_t inFrame;
+
+    // The values last written to REG_MACRO_0/1. macroKnown has bit m set
+    // when macroValues[m] matches the register, and macroPending has it set
+    // when a value set during the frame still has to be written.
+    uint32_t macroValues[2];
+    uint8_t macroKnown;
+    uint8_t macroPending;
+
+    // The segment being recorded, or -1
+    int16_t recordingSegment;
+
+    // The offset in RAM_DL where the current recording started
+    uint32_t recordStart;
+
+    // The layer being rendered, or -1
+    int16_t renderingLayer;
 
     // True if there currently is a finger touching the screen;
     uint8_t hasTouch;
@@ -206,6 +464,36 @@ typedef struct {
     // When the user touches one of those pixels, this will be the tag number.
     uint8_t touchTag;
 
+    // Registers read at the end of each frame. snapshotOrder lists the
+    // slots sorted by register address, so neighbours can be read together.
+    uint32_t snapshotRegs[FTGL_SNAPSHOT_REGISTERS];
+    uint32_t snapshotValues[FTGL_SNAPSHOT_REGISTERS];
+    uint8_t snapshotOrder[FTGL_SNAPSHOT_REGISTERS];
+    uint8_t snapshotCount;
+
+#if FTGL_DEFERRED_DRAWS > 0
+    // True between FTGLBeginBuffer and FTGLSwapBuffers, except while the
+    // held draws are being sent. deferredDirty is set when there are held
+    // draws or state that has not been sent yet.
+    uint8_t deferring;
+    uint8_t deferredDirty;
+
+    // The state set by the application, which is ahead of the graphics
+    // context cache while deferring.
+    DeferredState deferredState;
+
+    DeferredDraw deferredDraws[FTGL_DEFERRED_DRAWS];
+    uint8_t deferredCount;
+    char deferredText[FTGL_DEFERRED_TEXT_SIZE];
+    uint16_t deferredTextUsed;
+
+    // Widest character and line height of each ROM font, read from the FT800
+    // by FTGLInitialize. Reading them mid-frame would interrupt an open
+    // append write.
+    uint8_t fontWidth[16];
+    uint8_t fontHeight[16];
+#endif
+
 } FTGLInstance;
 
 // THE GLOBAL INSTANCE
@@ -248,16 +536,46 @@ static void WriteReg32(uint32_t addr, uint32_t val) {
 }
 
 
+// Blocks until every asynchronous transfer has been sent.
+static void WaitForTransfers(void) {
+#if FTGL_ASYNC_TRANSFER == 1
+    if (g_Inst.lastTicket >= 0) {
+        FTHWCompleteWrite(g_Inst.lastTicket);
+    }
+    g_Inst.bufferTickets[0] = -1;
+    g_Inst.bufferTickets[1] = -1;
+    g_Inst.cmdWriteTicket = -1;
+    g_Inst.lastTicket = -1;
+#endif
+}
+
 // Whenever the cmd queue is full, or at the
 // end of drawing a frame, we must wait for all of
 // the commands added so far to finish executing.
 static void WaitForQueueEmpty(void) {
     log(__FILE__, __LINE__, "Waiting for empty queue");
-    do {
+    WaitForTransfers();
+    for (;;) {
+#if FTGL_USE_INTERRUPTS == 1
+        if (g_Inst.interruptsAvailable) {
+            // Clear CMDEMPTY before looking at the queue, so that if it empties
+            // after the check below, the interrupt pin is still raised.
+            g_Inst.interruptFlags |= ReadReg8(FT_REG_INT_FLAGS);
+            g_Inst.interruptFlags &= ~FT_INT_CMDEMPTY;
+        }
+#endif
+        // REG_CMD_WRITE is always published before waiting, so it is
+        // already known.
         g_Inst.cmdQueueReadIndex = ReadReg16(FT_REG_CMD_READ);
-        g_Inst.cmdQueueWriteIndex = ReadReg16(FT_REG_CMD_WRITE);
-        // TODO(eric): Do I need to read the write index?
-    } while (g_Inst.cmdQueueReadIndex != g_Inst.cmdQueueWriteIndex);
+        if (g_Inst.cmdQueueReadIndex == g_Inst.cmdQueueWriteIndex) {
+            break;
+        }
+#if FTGL_USE_INTERRUPTS == 1
+        if (g_Inst.interruptsAvailable) {
+            FTHWWaitInterrupt(FTGL_INTERRUPT_TIMEOUT_MS);
+        }
+#endif
+    }
 
     g_Inst.cmdQueueFreeSpace = FTGL_CMD_QUEUE_SIZE;
     log(__FILE__, __LINE__, "Queue empty r(%d) w(%d) f(%d)",
@@ -266,43 +584,297 @@ static void WaitForQueueEmpty(void) {
         g_Inst.cmdQueueFreeSpace);
 }
 
+// Waits until the last display list swap has taken effect. Returns -1 if it
+// has not after FTGL_SWAP_TIMEOUT_MS.
+static int WaitForSwap(void) {
+    int32_t start = FTHWGetTicks();
+    for (;;) {
+#if FTGL_USE_INTERRUPTS == 1
+        if (g_Inst.interruptsAvailable) {
+            // Reading the flags lowers the interrupt pin, so a swap after the
+            // check below raises it again
+            g_Inst.interruptFlags |= ReadReg8(FT_REG_INT_FLAGS);
+        }
+#endif
+        if (ReadReg8(FT_REG_DLSWAP) == FT_DLSWAP_DONE) {
+            return 0;
+        }
+        if (FTHWGetTicks() - start >= FTGL_SWAP_TIMEOUT_MS) {
+            log(__FILE__, __LINE__, "Timed out waiting for swap");
+            return -1;
+        }
+#if FTGL_USE_INTERRUPTS == 1
+        if (g_Inst.interruptsAvailable) {
+            FTHWWaitInterrupt(FTGL_INTERRUPT_TIMEOUT_MS);
+            continue;
+        }
+#endif
+        FTHWDelayMS(1);
+    }
+}
+
 // Returns a count of milliseconds since some initialization point
 // This is not used for absolute time but to provide a delta between
 // each frame.
 int32_t FTGLGetTicks(void) { return FTHWGetTicks(); }
 
 
-// Updates the write index so that the ft800 begins running commands, and then
-// waits for all the commands to have been run.
-static void FlushCommands(void) {
-    log(__FILE__, __LINE__, "Command buffer full, flushing...");
-    FTHWEndAppendWrite();
+#if FTGL_ASYNC_TRANSFER == 0
+// Starts the append write at sendIndex, if it is not already started. This
+// is done when the first byte is sent rather than in BeginAppend, so that
+// nothing goes over the bus for a frame that ends up not being sent.
+static void OpenAppend(void) {
+    if (!g_Inst.appendOpen) {
+        FTHWBeginAppendWrite(FT_RAM_CMD + g_Inst.sendIndex);
+        g_Inst.appendOpen = 1;
+    }
+}
+#endif
+
+#if FTGL_FRAME_ELISION == 1
+// Continues a CRC-32 (the same polynomial as zlib and CMD_MEMCRC), a nibble
+// at a time. Start with 0xFFFFFFFF and invert the result.
+static uint32_t Crc32Update(uint32_t crc, const uint8_t *data, uint16_t count) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    while (count--) {
+        crc ^= *data++;
+        crc = (crc >> 4) ^ table[crc & 0xF];
+        crc = (crc >> 4) ^ table[crc & 0xF];
+    }
+    return crc;
+}
+
+// Every byte appended to a frame that may still be dropped goes into its CRC
+#define HASH_FRAME(data, count) do { \
+    if (g_Inst.frameHeld) { g_Inst.frameCrc = Crc32Update(g_Inst.frameCrc, (data), (count)); } \
+} while (0)
+#else
+#define HASH_FRAME(data, count)
+#endif
+
+// Sends bytes to the command queue at sendIndex. RAM_CMD addresses do not
+// wrap around on their own, so the write is restarted at the start of RAM_CMD
+// when it reaches the end.
+static void SendBytes(const uint8_t *data, uint16_t count) {
+    while (count > 0) {
+        uint16_t n = (uint16_t)(FT_CMDFIFO_SIZE - g_Inst.sendIndex);
+        if (n > count) { n = count; }
+#if FTGL_ASYNC_TRANSFER == 1
+        g_Inst.lastTicket = FTHWSubmitWrite(FT_RAM_CMD + g_Inst.sendIndex, data, n);
+#else
+        OpenAppend();
+        FTHWAppendWrite(data, n);
+#endif
+        g_Inst.sendIndex = (g_Inst.sendIndex + n) & FTGL_QUEUE_MASK;
+        data += n;
+        count -= n;
+#if FTGL_ASYNC_TRANSFER == 0
+        if (g_Inst.sendIndex == 0) {
+            FTHWEndAppendWrite();
+            g_Inst.appendOpen = 0;
+        }
+#endif
+    }
+}
+
+// Sends anything waiting in the write buffer as part of the current append
+// write.
+static void FlushWriteBuffer(void) {
+#if FTGL_WRITE_BUFFER_SIZE > 0
+    if (g_Inst.writeBufferCount > 0) {
+        SendBytes(WRITE_BUFFER(g_Inst), g_Inst.writeBufferCount);
+        g_Inst.writeBufferCount = 0;
+
+#if FTGL_ASYNC_TRANSFER == 1
+        // Switch to the other buffer, waiting for it if it is still being sent
+        g_Inst.bufferTickets[g_Inst.activeBuffer] = g_Inst.lastTicket;
+        g_Inst.activeBuffer ^= 1;
+        if (g_Inst.bufferTickets[g_Inst.activeBuffer] >= 0) {
+            FTHWCompleteWrite(g_Inst.bufferTickets[g_Inst.activeBuffer]);
+            g_Inst.bufferTickets[g_Inst.activeBuffer] = -1;
+        }
+#endif
+    }
+#endif
+}
+
+// Finishes the current append write. Use this instead of calling
+// FTHWEndAppendWrite directly, so the write buffer is not left behind.
+static void EndAppend(void) {
+    FlushWriteBuffer();
+#if FTGL_ASYNC_TRANSFER == 0
+    if (g_Inst.appendOpen) {
+        FTHWEndAppendWrite();
+        g_Inst.appendOpen = 0;
+    }
+#endif
+}
+
+// Starts writing commands at cmdQueueWriteIndex. Anything still buffered
+// from an append that was not ended is sent first, so that it goes to the
+// place in RAM_CMD it was counted at.
+static void BeginAppend(void) {
+    EndAppend();
+    g_Inst.sendIndex = g_Inst.cmdQueueWriteIndex;
+}
+
+// Updates REG_CMD_WRITE so the coprocessor runs everything written so far.
+static void PublishCommands(void) {
+#if FTGL_ASYNC_TRANSFER == 1
+    if (g_Inst.cmdWriteTicket >= 0) {
+        FTHWCompleteWrite(g_Inst.cmdWriteTicket);
+    }
+    g_Inst.cmdWriteValue = HOST_TO_FT_USHORT(g_Inst.cmdQueueWriteIndex);
+    g_Inst.lastTicket = FTHWSubmitWrite(FT_REG_CMD_WRITE, (const uint8_t*)&g_Inst.cmdWriteValue, sizeof(uint16_t));
+    g_Inst.cmdWriteTicket = g_Inst.lastTicket;
+#else
     WriteReg16(FT_REG_CMD_WRITE, g_Inst.cmdQueueWriteIndex);
-    WaitForQueueEmpty();
-    FTHWBeginAppendWrite(FT_RAM_CMD + g_Inst.cmdQueueWriteIndex);
+#endif
+    g_Inst.publishedIndex = g_Inst.cmdQueueWriteIndex;
+#if FTGL_FRAME_ELISION == 1
+    // The coprocessor may run it now, so it can not be taken back
+    g_Inst.frameHeld = 0;
+#endif
+}
+
+// Recalculates the free space from the coprocessor's read index. The queue
+// is full when the write index is 4 bytes behind the read index.
+static void UpdateFreeSpace(void) {
+    g_Inst.cmdQueueReadIndex = ReadReg16(FT_REG_CMD_READ);
+    g_Inst.cmdQueueFreeSpace = (g_Inst.cmdQueueReadIndex - g_Inst.cmdQueueWriteIndex - 4) & FTGL_QUEUE_MASK;
+}
+
+// Waits until the command queue has room for 'amt' more bytes. Unlike
+// WaitForQueueEmpty, this returns as soon as the coprocessor has made enough
+// room, so it can keep working on the rest of the queue while more commands
+// are written.
+static void WaitForSpace(uint16_t amt) {
+    EndAppend();
+    UpdateFreeSpace();
+    // A held frame is only published if it does not fit otherwise
+    if (g_Inst.publishedIndex != g_Inst.cmdQueueWriteIndex &&
+        (!FRAME_HELD() || g_Inst.cmdQueueFreeSpace < amt)) {
+        PublishCommands();
+    }
+    if (g_Inst.cmdQueueFreeSpace < amt) {
+        log(__FILE__, __LINE__, "Command buffer full, waiting for %d bytes", amt);
+        WaitForTransfers();
+        for (;;) {
+#if FTGL_USE_INTERRUPTS == 1
+            // There is no interrupt for free space, only for an empty queue.
+            // Sleeping until then is only worth it when most of the queue
+            // has to drain anyway. Otherwise, polling lets writing resume
+            // while the coprocessor still has commands to work on.
+            uint8_t sleep = g_Inst.interruptsAvailable &&
+                            amt - g_Inst.cmdQueueFreeSpace > FTGL_SPACE_SLEEP_SHORTFALL;
+            if (sleep) {
+                g_Inst.interruptFlags |= ReadReg8(FT_REG_INT_FLAGS);
+                g_Inst.interruptFlags &= ~FT_INT_CMDEMPTY;
+            }
+#endif
+            UpdateFreeSpace();
+            if (g_Inst.cmdQueueFreeSpace >= amt) {
+                break;
+            }
+#if FTGL_USE_INTERRUPTS == 1
+            if (sleep) {
+                FTHWWaitInterrupt(FTGL_INTERRUPT_TIMEOUT_MS);
+                continue;
+            }
+#endif
+            FTHWDelayMS(1);
+        }
+    }
+    BeginAppend();
+}
+
+#if FTGL_KICK_THRESHOLD > 0
+// Lets the coprocessor start on the commands written so far, without
+// waiting for it.
+static void KickCommands(void) {
+    EndAppend();
+    PublishCommands();
+    BeginAppend();
 }
+#endif
+
+#if FTGL_DEFERRED_DRAWS > 0
+#define DEFERRING() (g_Inst.deferring)
+static void FlushDeferred(void);
+// Anything that is not deferred sends the held draws and state first
+#define DEFER_BARRIER() do { if (g_Inst.deferredDirty) { FlushDeferred(); } } while (0)
+#else
+#define DEFERRING() 0
+#define DEFER_BARRIER()
+#endif
+
+#if FTGL_CACHE_GRAPHICS_CONTEXT == 1
+static void FlushTransforms(void);
+#define FLUSH_TRANSFORMS() do { if (g_Inst.transformPending) { FlushTransforms(); } } while (0)
+#else
+#define FLUSH_TRANSFORMS()
+#endif
 
 ///////////////////////////////////////////////////////
 // Functions to write data to the command queue
 
-static void EnsureSpace(int amt) {
-    if (g_Inst.cmdQueueFreeSpace < sizeof(amt)) { FlushCommands(); }
+// Called before every command with the number of bytes it needs, so it is
+// only ever called between commands.
+static void EnsureSpace(uint16_t amt) {
+    DEFER_BARRIER();
+    FLUSH_TRANSFORMS();
+    if (g_Inst.cmdQueueFreeSpace < amt) {
+        WaitForSpace(amt);
+    }
+#if FTGL_KICK_THRESHOLD > 0
+    else if (!FRAME_HELD() &&
+             ((g_Inst.cmdQueueWriteIndex - g_Inst.publishedIndex) & FTGL_QUEUE_MASK) >= FTGL_KICK_THRESHOLD) {
+        KickCommands();
+    }
+#endif
 }
 
-static uint16_t Aligned(uint16_t size) {
-    uint16_t val = size & 0x3;
-    if (val != 0) {
-        return size + (4 - val);
-    } else {
-        return size;
+// Every byte written to the command queue goes through here. With the
+// write buffer enabled, small writes are collected and sent together.
+static void AppendBytes(const uint8_t *data, uint16_t count) {
+    HASH_FRAME(data, count);
+    g_Inst.cmdQueueWriteIndex = (g_Inst.cmdQueueWriteIndex + count) & FTGL_QUEUE_MASK;
+    g_Inst.cmdQueueFreeSpace -= count;
+
+#if FTGL_WRITE_BUFFER_SIZE > 0
+#if FTGL_ASYNC_TRANSFER == 0
+    if (count >= FTGL_WRITE_BUFFER_SIZE) {
+        // Too big to be worth copying
+        FlushWriteBuffer();
+        SendBytes(data, count);
+        return;
+    }
+#endif
+
+    while (count > 0) {
+        uint16_t n = FTGL_WRITE_BUFFER_SIZE - g_Inst.writeBufferCount;
+        if (n > count) { n = count; }
+        memcpy(&WRITE_BUFFER(g_Inst)[g_Inst.writeBufferCount], data, n);
+        g_Inst.writeBufferCount += n;
+        data += n;
+        count -= n;
+        if (g_Inst.writeBufferCount == FTGL_WRITE_BUFFER_SIZE) {
+            FlushWriteBuffer();
+        }
     }
+#else
+    SendBytes(data, count);
+#endif
 }
 
 static void Append32(uint32_t val) {
     val = HOST_TO_FT_ULONG(val);
-    FTHWAppendWrite((uint8_t*)&val, sizeof(uint32_t));
-    g_Inst.cmdQueueWriteIndex = (g_Inst.cmdQueueWriteIndex + 4) & FTGL_QUEUE_MASK;
-    g_Inst.cmdQueueFreeSpace -= 4;
+    AppendBytes((const uint8_t*)&val, sizeof(uint32_t));
 }
 
 // All display list commands are 32 bit, so they use this call to ensure space and
@@ -314,49 +886,104 @@ static void DLCommand(uint32_t val) {
 
 static void Append16(uint16_t val) {
     val = HOST_TO_FT_USHORT(val);
-    FTHWAppendWrite((uint8_t*)&val, sizeof(uint16_t));
-    g_Inst.cmdQueueWriteIndex = (g_Inst.cmdQueueWriteIndex + 2) & FTGL_QUEUE_MASK;
-    g_Inst.cmdQueueFreeSpace -= 2;
+    AppendBytes((const uint8_t*)&val, sizeof(uint16_t));
 }
 
 /* Not used
 static void Append8(uint8_t val) {
-    FTHWAppendWrite(&val, sizeof(uint8_t));
-    g_Inst.cmdQueueWriteIndex = (g_Inst.cmdQueueWriteIndex + 1) & FTGL_QUEUE_MASK;
-    g_Inst.cmdQueueFreeSpace -= 1;
+    AppendBytes(&val, sizeof(uint8_t));
 }
  */
 
-static void AppendString(const uint8_t *data, uint16_t count) {
-    FTHWAppendWrite(data, count);
-    g_Inst.cmdQueueWriteIndex = (g_Inst.cmdQueueWriteIndex + count) & FTGL_QUEUE_MASK;
-    g_Inst.cmdQueueFreeSpace -= count;
+// Writes a group of buffers to the command queue as if they were one. Large
+// groups are handed to the platform as a single vectored write.
+static void AppendSegments(const FTHWSegment *segments, uint8_t segmentCount) {
+    uint8_t i;
+#if FTGL_ASYNC_TRANSFER == 0
+    uint16_t total = 0;
+    for (i = 0; i < segmentCount; i++) {
+        total += segments[i].count;
+    }
+#if FTGL_WRITE_BUFFER_SIZE > 0
+    if (total >= FTGL_WRITE_BUFFER_SIZE) {
+#endif
+        for (i = 0; i < segmentCount; i++) {
+            HASH_FRAME(segments[i].data, segments[i].count);
+        }
+        g_Inst.cmdQueueWriteIndex = (g_Inst.cmdQueueWriteIndex + total) & FTGL_QUEUE_MASK;
+        g_Inst.cmdQueueFreeSpace -= total;
+        FlushWriteBuffer();
+        if (g_Inst.sendIndex + total < FT_CMDFIFO_SIZE) {
+            OpenAppend();
+            FTHWAppendWritev(segments, segmentCount);
+            g_Inst.sendIndex += total;
+        } else {
+            // Reaches the end of RAM_CMD, so it has to be split
+            for (i = 0; i < segmentCount; i++) {
+                SendBytes(segments[i].data, segments[i].count);
+            }
+        }
+        return;
+#if FTGL_WRITE_BUFFER_SIZE > 0
+    }
+#endif
+#endif
+
+    // Small enough to be copied into the write buffer
+    for (i = 0; i < segmentCount; i++) {
+        AppendBytes(segments[i].data, segments[i].count);
+    }
 }
 
-static void AlignBuffer(void) {
-    uint16_t val = g_Inst.cmdQueueWriteIndex & 0x3;
-    if (val != 0) {
-        uint32_t zero = 0;
-        val = 4 - val;
-        FTHWAppendWrite((const uint8_t*)&zero, val);
-        g_Inst.cmdQueueWriteIndex = (g_Inst.cmdQueueWriteIndex + val) & FTGL_QUEUE_MASK;
-        g_Inst.cmdQueueFreeSpace -= val;
+// Headers for AppendPayloadCommand are built as arrays of 16 bit words
+#define HEADER16(x) HOST_TO_FT_USHORT((uint16_t)(x))
+#define HEADER_CMD(cmd) HEADER16((cmd) & 0xFFFF), HEADER16((uint32_t)(cmd) >> 16)
+
+// Writes a command that ends in a string or a block of data. The fixed size
+// header, the payload and the padding up to the next 4 byte boundary are sent
+// together, without copying the payload. Payloads too big for the command
+// queue are fed through it in pieces as the coprocessor consumes them.
+static void AppendPayloadCommand(const void *header, uint16_t headerCount, const uint8_t *data, uint32_t count) {
+    static const uint8_t padding[4] = { 0, 0, 0, 0 };
+    FTHWSegment segments[3];
+    uint32_t size = headerCount + count;
+    uint16_t padCount = (uint16_t)((4 - (size & 0x3)) & 0x3);
+
+    if (size + padCount <= FTGL_CMD_QUEUE_SIZE) {
+        EnsureSpace((uint16_t)(size + padCount));
+        segments[0].data = (const uint8_t*)header;
+        segments[0].count = headerCount;
+        segments[1].data = data;
+        segments[1].count = (uint16_t)count;
+        segments[2].data = padding;
+        segments[2].count = padCount;
+        AppendSegments(segments, padCount > 0 ? 3 : 2);
+        return;
+    }
+
+    EnsureSpace(headerCount);
+    AppendBytes((const uint8_t*)header, headerCount);
+    while (count > 0) {
+        uint16_t n = count > FTGL_PAYLOAD_CHUNK_SIZE ? FTGL_PAYLOAD_CHUNK_SIZE : (uint16_t)count;
+        EnsureSpace(n == count ? n + padCount : n);
+        AppendBytes(data, n);
+        data += n;
+        count -= n;
     }
+    AppendBytes(padding, padCount);
 }
 
-int FTGLInitialize(void) {
-    log(__FILE__, __LINE__, "Initializing FTGL");
-    int i;
-    memset(&g_Inst, 0, sizeof(g_Inst));
-    
 #if FTGL_CACHE_GRAPHICS_CONTEXT == 1
-    log(__FILE__, __LINE__, "Setting defaults in graphics context");
+// Sets the cached graphics context to the values the FT800 starts every
+// display list with.
+static void ResetGraphicsContext(void) {
+    int i;
     for (i = 0; i < FTGL_CONTEXT_STACK_SIZE; i++) {
         GRAPHICS_CONTEXT_INDEX(g_Inst, i).alphaFunc = FT_ALPHA_FUNC(FT_ALWAYS, 0);
-        GRAPHICS_CONTEXT_INDEX(g_Inst, i).stencilFunc = FT_STENCIL_FUNC(255, FT_ALWAYS, 0);
+        GRAPHICS_CONTEXT_INDEX(g_Inst, i).stencilFunc = FT_STENCIL_FUNC(FT_ALWAYS, 0, 255);
         GRAPHICS_CONTEXT_INDEX(g_Inst, i).blendFunc = FT_BLEND_FUNC(FT_SRC_ALPHA, FT_ONE_MINUS_SRC_ALPHA);
         GRAPHICS_CONTEXT_INDEX(g_Inst, i).bitmapCell = FT_CELL(0);
-        GRAPHICS_CONTEXT_INDEX(g_Inst, i).colorAlpha = FT_COLOR_A(0);
+        GRAPHICS_CONTEXT_INDEX(g_Inst, i).colorAlpha = FT_COLOR_A(255);
         GRAPHICS_CONTEXT_INDEX(g_Inst, i).colorRGB = FT_COLOR_RGB(255, 255, 255);
         GRAPHICS_CONTEXT_INDEX(g_Inst, i).lineWidth = FT_LINE_WIDTH(16);
         GRAPHICS_CONTEXT_INDEX(g_Inst, i).pointSize = FT_POINT_SIZE(16);
@@ -370,47 +997,209 @@ int FTGLInitialize(void) {
         GRAPHICS_CONTEXT_INDEX(g_Inst, i).tagMask = FT_TAG_MASK(1);
         GRAPHICS_CONTEXT_INDEX(g_Inst, i).clearColorAlpha = FT_CLEAR_COLOR_A(0);
         GRAPHICS_CONTEXT_INDEX(g_Inst, i).clearColorRGB = FT_CLEAR_COLOR_RGB(0, 0, 0);
+        GRAPHICS_CONTEXT_INDEX(g_Inst, i).colorMask = FT_COLOR_MASK(1, 1, 1, 1);
+        GRAPHICS_CONTEXT_INDEX(g_Inst, i).bitmapTransform[BMP_TRANSFORM_A] = FT_BITMAP_TRANSFORM_A(256);
+        GRAPHICS_CONTEXT_INDEX(g_Inst, i).bitmapTransform[BMP_TRANSFORM_B] = FT_BITMAP_TRANSFORM_B(0);
+        GRAPHICS_CONTEXT_INDEX(g_Inst, i).bitmapTransform[BMP_TRANSFORM_C] = FT_BITMAP_TRANSFORM_C(0);
+        GRAPHICS_CONTEXT_INDEX(g_Inst, i).bitmapTransform[BMP_TRANSFORM_D] = FT_BITMAP_TRANSFORM_D(0);
+        GRAPHICS_CONTEXT_INDEX(g_Inst, i).bitmapTransform[BMP_TRANSFORM_E] = FT_BITMAP_TRANSFORM_E(256);
+        GRAPHICS_CONTEXT_INDEX(g_Inst, i).bitmapTransform[BMP_TRANSFORM_F] = FT_BITMAP_TRANSFORM_F(0);
+        // A display list does not start with any primitive
+        GRAPHICS_CONTEXT_INDEX(g_Inst, i).primitive = 0xFFFFFFFFUL;
     }
-    
-    delay(50);
-    
 #if FTGL_CONTEXT_STACK_SIZE > 1
     g_Inst.contextStackIndex = 0;
+    g_Inst.contextHardware = 0;
+    g_Inst.contextOverflow = 0;
 #endif
+    g_Inst.transformPending = 0;
+}
+
+// Marks the current graphics context as unknown, so that the next change to
+// any value is always sent. No display list command is all ones, so the
+// cache never matches it.
+static void InvalidateGraphicsContext(void) {
+    memset(&GRAPHICS_CONTEXT(g_Inst), 0xFF, sizeof(GraphicsContext));
+}
 
+// Coprocessor commands that draw leave their own primitive behind
+#define InvalidatePrimitive() (GRAPHICS_CONTEXT(g_Inst).primitive = 0xFFFFFFFFUL)
+#else
+#define ResetGraphicsContext()
+#define InvalidateGraphicsContext()
+#define InvalidatePrimitive()
 #endif
 
+// Forgets which bitmaps are loaded into which handles, so that they are
+// loaded again the next time they are used.
+static void InvalidateBitmapHandles(void) {
+#if FTGL_CACHE_BITMAP_HANDLES == 1
+    int i;
+    for (i = 0; i < FTGL_NUM_BITMAP_HANDLES; i++) {
+        if (g_Inst.bitmapHandles[i] >= 0) {
+            g_Inst.bitmaps[g_Inst.bitmapHandles[i]].activeHandle = -1;
+            g_Inst.bitmapHandles[i] = -1;
+        }
+    }
+#endif
+}
+
+// Forgets that a bitmap is loaded into a handle, if it is
+static void UnloadBitmap(int id) {
+#if FTGL_CACHE_BITMAP_HANDLES == 1
+    if (g_Inst.bitmaps[id].activeHandle >= 0) {
+        g_Inst.bitmapHandles[g_Inst.bitmaps[id].activeHandle] = -1;
+        g_Inst.bitmaps[id].activeHandle = -1;
+    }
+#else
+    (void)id;
+#endif
+}
+
+//// RAM_G allocation
+// The number of blocks is small (one per bitmap and segment), so they are
+// kept in an array sorted by address, and new blocks go in the smallest gap
+// between them that fits.
+
+// Returns the address of a new block of at least size bytes, or
+// FTGL_RAM_NONE if there is no gap large enough.
+static uint32_t AllocateRam(uint32_t size, uint8_t ownerType, int16_t ownerId) {
+    uint32_t prevEnd = FT_RAM_G, bestAddress = FTGL_RAM_NONE, bestGap = 0xFFFFFFFFUL;
+    uint8_t i, bestIndex = 0;
+    RamBlock *block;
+
+    if (g_Inst.ramBlockCount == FTGL_RAM_BLOCKS) { return FTGL_RAM_NONE; }
+
+    // Keep every block 4 byte aligned, for CMD_MEMCPY and CMD_APPEND
+    size = (size + 3) & ~3UL;
+    for (i = 0; i <= g_Inst.ramBlockCount; i++) {
+        uint32_t end = i < g_Inst.ramBlockCount ? g_Inst.ramBlocks[i].address : FT_RAM_G + FT_RAM_G_SIZE;
+        uint32_t gap = end - prevEnd;
+        if (gap >= size && gap < bestGap) {
+            bestGap = gap;
+            bestAddress = prevEnd;
+            bestIndex = i;
+        }
+        if (i < g_Inst.ramBlockCount) {
+            prevEnd = g_Inst.ramBlocks[i].address + g_Inst.ramBlocks[i].size;
+        }
+    }
+    if (bestAddress == FTGL_RAM_NONE) { return FTGL_RAM_NONE; }
+
+    memmove(&g_Inst.ramBlocks[bestIndex + 1], &g_Inst.ramBlocks[bestIndex],
+            (g_Inst.ramBlockCount - bestIndex) * sizeof(RamBlock));
+    g_Inst.ramBlockCount++;
+
+    block = &g_Inst.ramBlocks[bestIndex];
+    block->address = bestAddress;
+    block->size = size;
+    block->ownerType = ownerType;
+    block->ownerId = ownerId;
+    return bestAddress;
+}
+
+static void FreeRam(uint32_t address) {
+    uint8_t i;
+    for (i = 0; i < g_Inst.ramBlockCount; i++) {
+        if (g_Inst.ramBlocks[i].address == address) {
+            g_Inst.ramBlockCount--;
+            memmove(&g_Inst.ramBlocks[i], &g_Inst.ramBlocks[i + 1],
+                    (g_Inst.ramBlockCount - i) * sizeof(RamBlock));
+            return;
+        }
+    }
+}
+
+#if FTGL_DEFERRED_DRAWS > 0
+// The ROM font table holds a 148 byte block per font, with the widest
+// character and line height at offsets 136 and 140
+static void LoadFontMetrics(void) {
+    uint32_t metrics[2];
+    uint8_t f;
+    for (f = 0; f < 16; f++) {
+        FTHWRead(FT_ROM_FONT + 148UL * f + 136, (uint8_t*)metrics, sizeof(metrics));
+        g_Inst.fontWidth[f] = (uint8_t)FT_TO_HOST_ULONG(metrics[0]);
+        g_Inst.fontHeight[f] = (uint8_t)FT_TO_HOST_ULONG(metrics[1]);
+    }
+}
+#endif
+
+// Writes a display list that clears the screen to black straight into
+// RAM_DL and asks for it to be swapped in at the next frame.
+static void WriteBlankScreen(void) {
+    WriteReg32(FT_RAM_DL, FT_CLEAR_COLOR_RGB(0, 0, 0)); 
+    WriteReg32(FT_RAM_DL + 4, FT_CLEAR(1, 1, 1));
+    WriteReg32(FT_RAM_DL + 8, FT_DISPLAY());
+    WriteReg32(FT_REG_DLSWAP, FT_DLSWAP_FRAME);
+}
+
+int FTGLInitialize(void) {
+    log(__FILE__, __LINE__, "Initializing FTGL");
+    int i;
+    memset(&g_Inst, 0, sizeof(g_Inst));
+    
+#if FTGL_CACHE_GRAPHICS_CONTEXT == 1
+    log(__FILE__, __LINE__, "Setting defaults in graphics context");
+    ResetGraphicsContext();
+    delay(50);
+#endif
+
+    FTGLLoadIdentity();
+
 #if FTGL_CACHE_COMMAND_CONTEXT == 1
     log(__FILE__, __LINE__, "Settings defaults in command context");
     g_Inst.commandContext.bgColor =   0x002040;
     g_Inst.commandContext.fgColor =   0x003870;
     g_Inst.commandContext.gradColor = 0xffffff;
     g_Inst.commandContext.continuousCommandActive = 0;
+    g_Inst.commandContext.matrixIdentity = 1;
     delay(50);
 #endif
 
     log(__FILE__, __LINE__, "Initializing touch and bitmap info");
-    g_Inst.lastHandle = -1;
-    g_Inst.nextHandle = 0;
-    g_Inst.graphicsRamIndex = FT_RAM_G;
+    g_Inst.ramBlockCount = 0;
+    g_Inst.segmentCount = 0;
+    g_Inst.recordingSegment = -1;
+    g_Inst.renderingLayer = -1;
+    g_Inst.inFrame = 0;
+    g_Inst.macroKnown = 0;
+    g_Inst.macroPending = 0;
 
     g_Inst.hasTouch = 0;
     g_Inst.touchX = 0;
     g_Inst.touchY = 0;
     g_Inst.touchTag = 0;
 
+    g_Inst.snapshotCount = 0;
+    FTGLSnapshotRegister(FT_REG_TOUCH_SCREEN_XY);
+    FTGLSnapshotRegister(FT_REG_TOUCH_TAG);
+
     for (i = 0; i < FTGL_MAX_BITMAPS; i++) {
         g_Inst.bitmaps[i].activeHandle = -1;
+        g_Inst.bitmaps[i].allocated = 0;
+        g_Inst.bitmaps[i].pinned = 0;
     }
 
+#if FTGL_CACHE_BITMAP_HANDLES == 1
     for (i = 0; i < FTGL_NUM_BITMAP_HANDLES; i++) {
         g_Inst.bitmapHandles[i] = -1;
+        g_Inst.handleLastUse[i] = 0;
     }
+    g_Inst.handleUseCount = 0;
+    g_Inst.pinnedCount = 0;
+#endif
 
     g_Inst.cmdQueueReadIndex = 0;
     g_Inst.cmdQueueWriteIndex = 0;
     g_Inst.cmdQueueFreeSpace = FTGL_CMD_QUEUE_SIZE;
     // NOTE: Command queue index must always be 4 byte aligned
+
+#if FTGL_ASYNC_TRANSFER == 1
+    g_Inst.bufferTickets[0] = -1;
+    g_Inst.bufferTickets[1] = -1;
+    g_Inst.cmdWriteTicket = -1;
+    g_Inst.lastTicket = -1;
+#endif
  
 
     log(__FILE__, __LINE__, "Initializing spi h/w");
@@ -483,10 +1272,7 @@ int FTGLInitialize(void) {
 
     log(__FILE__, __LINE__, "Draw a blank screen.");
     // Draw blank screen
-    WriteReg32(FT_RAM_DL, FT_CLEAR_COLOR_RGB(0, 0, 0)); 
-    WriteReg32(FT_RAM_DL + 4, FT_CLEAR(1, 1, 1));
-    WriteReg32(FT_RAM_DL + 8, FT_DISPLAY());
-    WriteReg32(FT_REG_DLSWAP, FT_DLSWAP_FRAME);
+    WriteBlankScreen();
 
     log(__FILE__, __LINE__, "Start the display");
 
@@ -496,15 +1282,21 @@ int FTGLInitialize(void) {
     WriteReg8(FT_REG_GPIO, gpio);
     WriteReg8(FT_REG_PCLK, FT_DISPLAY_PCLK);
 
-    /*
+#if FTGL_DEFERRED_DRAWS > 0
+    LoadFontMetrics();
+#endif
+
+#if FTGL_USE_INTERRUPTS == 1
     // Enable interrupts
-    if (FTHWInterruptAvailable()) {
-        WriteReg32(FT_REG_INT_EN, 1);
-        ReadReg32(FT_REG_INT_FLAGS);
-        WriteReg32(FT_REG_INT_MASK, FT_INT_CMDEMPTY);
-        ReadReg32(FT_REG_INT_FLAGS);
+    g_Inst.interruptsAvailable = (uint8_t)FTHWInterruptAvailable();
+    g_Inst.interruptFlags = 0;
+    g_Inst.interruptMask = FT_INT_CMDEMPTY | FT_INT_SWAP | FT_INT_CMDFLAG;
+    if (g_Inst.interruptsAvailable) {
+        WriteReg8(FT_REG_INT_MASK, g_Inst.interruptMask);
+        ReadReg8(FT_REG_INT_FLAGS);
+        WriteReg8(FT_REG_INT_EN, 1);
     }
-    */
+#endif
 
 
     log(__FILE__, __LINE__, "Raise the backlight");
@@ -521,35 +1313,190 @@ int FTGLInitialize(void) {
     return 0;
 }
 
+// Reads every snapshot register, in as few transfers as possible
+static void ReadSnapshot(void) {
+    uint8_t burst[FTGL_SNAPSHOT_MAX_BURST];
+    uint8_t first = 0, last, i;
+    uint32_t start, end, val;
+
+    while (first < g_Inst.snapshotCount) {
+        // Extend the transfer over every register close enough to the last one
+        start = g_Inst.snapshotRegs[g_Inst.snapshotOrder[first]];
+        end = start + sizeof(uint32_t);
+        for (last = first; last + 1 < g_Inst.snapshotCount; last++) {
+            uint32_t next = g_Inst.snapshotRegs[g_Inst.snapshotOrder[last + 1]];
+            if (next - end > FTGL_SNAPSHOT_MAX_GAP ||
+                next + sizeof(uint32_t) - start > FTGL_SNAPSHOT_MAX_BURST) {
+                break;
+            }
+            end = next + sizeof(uint32_t);
+        }
+
+        FTHWRead(start, burst, (uint16_t)(end - start));
+        for (i = first; i <= last; i++) {
+            uint8_t slot = g_Inst.snapshotOrder[i];
+            memcpy(&val, &burst[g_Inst.snapshotRegs[slot] - start], sizeof(uint32_t));
+            g_Inst.snapshotValues[slot] = FT_TO_HOST_ULONG(val);
+        }
+        first = last + 1;
+    }
+}
+
+// Reads the touch information for the frame that just finished
+static void ReadTouch(void) {
+    uint32_t val;
+    ReadSnapshot();
+    g_Inst.touchTag = (uint8_t)g_Inst.snapshotValues[SNAPSHOT_TOUCH_TAG];
+    val = g_Inst.snapshotValues[SNAPSHOT_TOUCH_SCREEN_XY];
+    if (val == 0x80008000) {
+        g_Inst.hasTouch = 0;
+    } else {
+        g_Inst.hasTouch = 1;
+        g_Inst.touchY = (int16_t)(val & 0xFFFF);
+        g_Inst.touchX = (int16_t)((val >> 16) & 0xFFFF);
+    }
+}
+
+// Macro values set during a frame are written once that frame has replaced
+// the one on the screen, so the frame being displayed never sees them
+// early. The registers are written by the host, so a frame that only
+// changed a macro value can still be dropped as unchanged. If the swap never
+// completes, there is no frame to protect, so they are written anyway.
+static void WritePendingMacros(void) {
+    uint8_t m;
+    if (!g_Inst.macroPending) { return; }
+    WaitForQueueEmpty();
+    WaitForSwap();
+    for (m = 0; m < 2; m++) {
+        if (g_Inst.macroPending & (1 << m)) {
+            WriteReg32(m ? FT_REG_MACRO_1 : FT_REG_MACRO_0, g_Inst.macroValues[m]);
+        }
+    }
+    g_Inst.macroPending = 0;
+}
+
 void FTGLBeginBuffer() {
     log(__FILE__, __LINE__, "Starting new buffer.");
-    FTHWBeginAppendWrite(FT_RAM_CMD + g_Inst.cmdQueueWriteIndex);
+#if FTGL_ASYNC_TRANSFER == 1
+    if (g_Inst.framePending) {
+        WaitForQueueEmpty();
+        ReadTouch();
+        g_Inst.framePending = 0;
+    }
+#endif
+    WritePendingMacros();
+    BeginAppend();
+    g_Inst.inFrame = 1;
+#if FTGL_CACHE_BITMAP_HANDLES == 1
+    g_Inst.handlesLoaded = 0;
+    g_Inst.handlesCarried = 0;
+    memset(&g_Inst.handleStats, 0, sizeof(g_Inst.handleStats));
+#endif
+#if FTGL_FRAME_ELISION == 1
+    g_Inst.frameHeld = 1;
+    g_Inst.frameStart = g_Inst.cmdQueueWriteIndex;
+    g_Inst.frameCrc = 0xFFFFFFFF;
+#endif
+    // Every display list starts with the default graphics state
+    ResetGraphicsContext();
+#if FTGL_CLIP_STACK_DEPTH > 0
+    g_Inst.clipIndex = 0;
+    g_Inst.clipStack[0].x0 = 0;
+    g_Inst.clipStack[0].y0 = 0;
+    g_Inst.clipStack[0].x1 = 512;
+    g_Inst.clipStack[0].y1 = 512;
+#endif
     FTGLCmdDLStart();
     FTGLClear(FT_CLEAR_C); 
     // TODO(eric): This clear is here because the first few frames
     // rendered by the FT800 appear to be incorrect (vertically stretched)
     // Instead of requiring a clear every frame, remove this and make initialization
     // draw a number of dummy frames.
+
+#if FTGL_DEFERRED_DRAWS > 0
+    g_Inst.deferredState.colorRGB = GRAPHICS_CONTEXT(g_Inst).colorRGB;
+    g_Inst.deferredState.colorAlpha = GRAPHICS_CONTEXT(g_Inst).colorAlpha;
+    g_Inst.deferredState.tag = GRAPHICS_CONTEXT(g_Inst).tag;
+    g_Inst.deferredState.fgColor = g_Inst.commandContext.fgColor;
+    g_Inst.deferredState.gradColor = g_Inst.commandContext.gradColor;
+    g_Inst.deferredCount = 0;
+    g_Inst.deferredTextUsed = 0;
+    g_Inst.deferredDirty = 0;
+    g_Inst.deferring = 1;
+#endif
+}
+
+#if FTGL_FRAME_ELISION == 1
+// Returns true if the frame is the same as the one on the screen, and drops
+// it if so. Whatever part of it was already sent to RAM_CMD was never
+// published, so the coprocessor never sees it.
+static int DropUnchangedFrame(void) {
+    uint32_t crc;
+
+    if (!g_Inst.frameHeld) {
+        g_Inst.lastFrameValid = 0;
+        return 0;
+    }
+    g_Inst.frameHeld = 0;
+
+    crc = ~g_Inst.frameCrc;
+    if (g_Inst.lastFrameValid && crc == g_Inst.lastFrameCrc) {
+        // Take the frame back out of the command queue
+        g_Inst.cmdQueueFreeSpace += (g_Inst.cmdQueueWriteIndex - g_Inst.frameStart) & FTGL_QUEUE_MASK;
+        g_Inst.cmdQueueWriteIndex = g_Inst.frameStart;
+        g_Inst.sendIndex = g_Inst.frameStart;
+#if FTGL_WRITE_BUFFER_SIZE > 0
+        g_Inst.writeBufferCount = 0;
+#endif
+#if FTGL_ASYNC_TRANSFER == 0
+        if (g_Inst.appendOpen) {
+            FTHWEndAppendWrite();
+            g_Inst.appendOpen = 0;
+        }
+#endif
+        return 1;
+    }
+
+    g_Inst.lastFrameCrc = crc;
+    g_Inst.lastFrameValid = 1;
+    return 0;
+}
+#endif
+
+void FTGLInvalidateFrame(void) {
+#if FTGL_FRAME_ELISION == 1
+    g_Inst.lastFrameValid = 0;
+#endif
 }
 
 void FTGLSwapBuffers(void) {
     log(__FILE__, __LINE__, "Swapping buffer.");
-    uint32_t val;
+#if FTGL_DEFERRED_DRAWS > 0
+    DEFER_BARRIER();
+    g_Inst.deferring = 0;
+#endif
     FTGLDisplay();
     FTGLCmdSwap();
-    FTHWEndAppendWrite();
-    WriteReg16(FT_REG_CMD_WRITE, g_Inst.cmdQueueWriteIndex);
-    WaitForQueueEmpty();
-
-    g_Inst.touchTag = (uint8_t)ReadReg16(FT_REG_TOUCH_TAG);
-    val = ReadReg32(FT_REG_TOUCH_SCREEN_XY);
-    if (val == 0x80008000) {
-        g_Inst.hasTouch = 0;
-    } else {
-        g_Inst.hasTouch = 1;
-        g_Inst.touchY = (int16_t)(val & 0xFFFF);
-        g_Inst.touchX = (int16_t)((val >> 16) & 0xFFFF);
+    g_Inst.inFrame = 0;
+#if FTGL_FRAME_ELISION == 1
+    if (DropUnchangedFrame()) {
+        log(__FILE__, __LINE__, "Frame unchanged, not sending it.");
+        WritePendingMacros();
+        ReadTouch();
+        return;
     }
+#endif
+    EndAppend();
+    PublishCommands();
+#if FTGL_ASYNC_TRANSFER == 1
+    // The wait for this frame, and the macro writes after it, happen in the
+    // next FTGLBeginBuffer
+    g_Inst.framePending = 1;
+#else
+    WaitForQueueEmpty();
+    WritePendingMacros();
+    ReadTouch();
+#endif
 }
 
 int FTGLHasTouch(void) { return g_Inst.hasTouch; }
@@ -557,6 +1504,67 @@ int FTGLTouchX(void) { return g_Inst.touchX; }
 int FTGLTouchY(void) { return g_Inst.touchY; }
 int FTGLTouchTag(void) { return g_Inst.touchTag; }
 
+int FTGLSnapshotRegister(uint32_t reg) {
+    uint8_t i, slot;
+
+    if ((reg & 0x3) != 0) { return -1; }
+    for (i = 0; i < g_Inst.snapshotCount; i++) {
+        if (g_Inst.snapshotRegs[i] == reg) { return i; }
+    }
+    if (g_Inst.snapshotCount == FTGL_SNAPSHOT_REGISTERS) { return -1; }
+
+    slot = g_Inst.snapshotCount++;
+    g_Inst.snapshotRegs[slot] = reg;
+    g_Inst.snapshotValues[slot] = 0;
+
+    // Insert into the address order
+    for (i = slot; i > 0 && g_Inst.snapshotRegs[g_Inst.snapshotOrder[i - 1]] > reg; i--) {
+        g_Inst.snapshotOrder[i] = g_Inst.snapshotOrder[i - 1];
+    }
+    g_Inst.snapshotOrder[i] = slot;
+    return slot;
+}
+
+uint32_t FTGLSnapshotValue(int slot) {
+    if (slot < 0 || slot >= g_Inst.snapshotCount) { return 0; }
+    return g_Inst.snapshotValues[slot];
+}
+
+int FTGLWaitInterrupt(uint8_t mask, int timeoutMS) {
+#if FTGL_USE_INTERRUPTS == 1
+    int32_t start = FTHWGetTicks();
+    int32_t remaining;
+    uint8_t found;
+
+    if (!g_Inst.interruptsAvailable) { return -1; }
+
+    // Make sure the interrupts being waited for raise the interrupt pin
+    if ((mask & ~g_Inst.interruptMask) != 0) {
+        g_Inst.interruptMask |= mask;
+        WriteReg8(FT_REG_INT_MASK, g_Inst.interruptMask);
+    }
+
+    for (;;) {
+        g_Inst.interruptFlags |= ReadReg8(FT_REG_INT_FLAGS);
+        found = g_Inst.interruptFlags & mask;
+        if (found) {
+            g_Inst.interruptFlags &= ~found;
+            return found;
+        }
+
+        remaining = timeoutMS - (FTHWGetTicks() - start);
+        if (remaining <= 0) {
+            return 0;
+        }
+        FTHWWaitInterrupt((int)remaining);
+    }
+#else
+    (void)mask;
+    (void)timeoutMS;
+    return -1;
+#endif
+}
+
 ////////////////////////////////////////////////////////
 // Display list commands (primitives and low level stuff)
 // Use these only between BeginBuffer and SwapBuffers
@@ -564,9 +1572,10 @@ int FTGLTouchTag(void) { return g_Inst.touchTag; }
 
 // If we cache the graphics context, check it and only send 
 // commands if they change the context
-#ifdef FTGL_CACHE_GRAPHICS_CONTEXT
+#if FTGL_CACHE_GRAPHICS_CONTEXT == 1
 #define WRITE_DLCMD(cache, value) do {  \
         uint32_t computedValue = value; \
+        DEFER_BARRIER(); \
         if (cache != computedValue) { \
             cache = computedValue; \
             DLCommand(computedValue); \
@@ -576,14 +1585,285 @@ int FTGLTouchTag(void) { return g_Inst.touchTag; }
 #define WRITE_DLCMD(cache, value) DLCommand(value)
 #endif
 
+#if FTGL_DEFERRED_DRAWS > 0
+// State that deferred draws depend on is held until the draws are sent
+#define WRITE_STATE(field, value) do { \
+        if (DEFERRING()) { \
+            g_Inst.deferredState.field = value; \
+            g_Inst.deferredDirty = 1; \
+        } else { \
+            WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).field, value); \
+        } \
+    } while (0)
+#else
+#define WRITE_STATE(field, value) WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).field, value)
+#endif
+
+#if FTGL_DEFERRED_DRAWS > 0
+//// Deferred draws
+
+static int16_t ClampCoord(int32_t v) {
+    if (v < -32768) { return -32768; }
+    if (v > 32767) { return 32767; }
+    return (int16_t)v;
+}
+
+// Finds the area a draw may cover. When it is not known (custom fonts, or
+// the font metrics read as zero), the draw covers everything.
+static void ComputeDeferredBox(DeferredDraw *draw) {
+    int32_t x0 = draw->x, y0 = draw->y, w = 0, h = 0;
+
+    if (draw->type == DEFER_BITMAP) {
+        uint32_t size = g_Inst.bitmaps[draw->font].bitmapSize;
+        w = (size >> 9) & 511;
+        h = size & 511;
+        if (w == 0) { w = 512; }
+        if (h == 0) { h = 512; }
+    } else if (draw->type == DEFER_BUTTON) {
+        w = draw->w;
+        h = draw->h;
+    } else if (draw->font >= 16 && draw->font <= 31) {
+        uint8_t f = (uint8_t)(draw->font - 16);
+        int32_t chars = 0;
+
+        if (draw->type == DEFER_TEXT) {
+            const char *text = g_Inst.deferredText + draw->text;
+            while (chars < draw->textLen && text[chars] != '\0') { chars++; }
+        } else {
+            uint32_t n = draw->n < 0 && (draw->options & FT_OPT_SIGNED) ? -(uint32_t)draw->n : (uint32_t)draw->n;
+            chars = draw->n < 0 && (draw->options & FT_OPT_SIGNED) ? 2 : 1;
+            while (n >= 10) { n /= 10; chars++; }
+        }
+        w = chars * g_Inst.fontWidth[f];
+        h = g_Inst.fontHeight[f];
+        if (draw->options & FT_OPT_CENTERX) { x0 -= w / 2; }
+        else if (draw->options & FT_OPT_RIGHTX) { x0 -= w; }
+        if (draw->options & FT_OPT_CENTERY) { y0 -= h / 2; }
+    }
+
+    if (w == 0 || h == 0) {
+        draw->box[0] = draw->box[1] = -32768;
+        draw->box[2] = draw->box[3] = 32767;
+        return;
+    }
+
+    // A little extra for antialiased edges and button shading
+    draw->box[0] = ClampCoord(x0 - 2);
+    draw->box[1] = ClampCoord(y0 - 2);
+    draw->box[2] = ClampCoord(x0 + w + 2);
+    draw->box[3] = ClampCoord(y0 + h + 2);
+}
+
+static int DeferredOverlap(const DeferredDraw *a, const DeferredDraw *b) {
+    return a->box[0] < b->box[2] && b->box[0] < a->box[2] &&
+           a->box[1] < b->box[3] && b->box[1] < a->box[3];
+}
+
+// Holds a draw to be sent later. Returns false if it can not be held, in
+// which case it must be drawn now.
+static int DeferDraw(uint8_t type, int16_t x, int16_t y, int16_t w, int16_t h,
+                     int16_t font, uint16_t options, int32_t n, const char *text, uint16_t len) {
+    DeferredDraw *draw;
+
+    if (len > FTGL_DEFERRED_TEXT_SIZE) { return 0; }
+    if (g_Inst.deferredCount == FTGL_DEFERRED_DRAWS ||
+        g_Inst.deferredTextUsed + len > FTGL_DEFERRED_TEXT_SIZE) {
+        FlushDeferred();
+    }
+
+    draw = &g_Inst.deferredDraws[g_Inst.deferredCount++];
+    draw->state = g_Inst.deferredState;
+    draw->type = type;
+    draw->x = x;
+    draw->y = y;
+    draw->w = w;
+    draw->h = h;
+    draw->font = font;
+    draw->options = options;
+    draw->n = n;
+
+    // The caller's string may change before the draw is sent
+    draw->text = g_Inst.deferredTextUsed;
+    draw->textLen = len;
+    if (len > 0) {
+        memcpy(g_Inst.deferredText + g_Inst.deferredTextUsed, text, len);
+        g_Inst.deferredTextUsed += len;
+    }
+
+    ComputeDeferredBox(draw);
+    g_Inst.deferredDirty = 1;
+    return 1;
+}
+
+// How many state commands sending the draw now would take
+static uint8_t DeferredCost(const DeferredDraw *draw) {
+    uint8_t cost = 0;
+    cost += draw->state.colorRGB != GRAPHICS_CONTEXT(g_Inst).colorRGB;
+    cost += draw->state.colorAlpha != GRAPHICS_CONTEXT(g_Inst).colorAlpha;
+    cost += draw->state.tag != GRAPHICS_CONTEXT(g_Inst).tag;
+    if (draw->type == DEFER_BUTTON) {
+        cost += draw->state.fgColor != g_Inst.commandContext.fgColor;
+        if (!(draw->options & FT_OPT_FLAT)) {
+            cost += draw->state.gradColor != g_Inst.commandContext.gradColor;
+        }
+    } else if (draw->type == DEFER_BITMAP) {
+        cost += GRAPHICS_CONTEXT(g_Inst).primitive != FT_BEGIN(FT_BITMAPS);
+    }
+    return cost;
+}
+
+static void SendDeferredDraw(const DeferredDraw *draw) {
+    WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).colorRGB, draw->state.colorRGB);
+    WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).colorAlpha, draw->state.colorAlpha);
+    WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).tag, draw->state.tag);
+
+    switch (draw->type) {
+    case DEFER_BITMAP:
+        FTGLCmdBitmapCell(draw->font, draw->x, draw->y, draw->options);
+        break;
+    case DEFER_TEXT:
+        FTGLCmdText(draw->x, draw->y, draw->font, draw->options,
+                    g_Inst.deferredText + draw->text, draw->textLen);
+        break;
+    case DEFER_NUMBER:
+        FTGLCmdNumber(draw->x, draw->y, draw->font, draw->options, draw->n);
+        break;
+    case DEFER_BUTTON:
+        FTGLCmdFGColor(draw->state.fgColor);
+        if (!(draw->options & FT_OPT_FLAT)) {
+            FTGLCmdGradColor(draw->state.gradColor);
+        }
+        FTGLCmdButton(draw->x, draw->y, draw->w, draw->h, draw->font, draw->options,
+                      g_Inst.deferredText + draw->text, draw->textLen);
+        break;
+    }
+}
+
+// Sends the held draws, then the current state. Each step sends the draw
+// that needs the fewest state changes out of the draws that do not overlap
+// an earlier draw that has not been sent yet.
+static void FlushDeferred(void) {
+    // Bit j of overlaps[i] is set if draw j comes before draw i and overlaps it
+    uint32_t overlaps[FTGL_DEFERRED_DRAWS];
+    uint32_t remaining;
+    uint8_t i, j, count = g_Inst.deferredCount;
+    uint8_t wasDeferring = g_Inst.deferring;
+
+    g_Inst.deferring = 0;
+    g_Inst.deferredDirty = 0;
+
+    for (i = 0; i < count; i++) {
+        overlaps[i] = 0;
+        for (j = 0; j < i; j++) {
+            if (DeferredOverlap(&g_Inst.deferredDraws[i], &g_Inst.deferredDraws[j])) {
+                overlaps[i] |= 1UL << j;
+            }
+        }
+    }
+
+    remaining = count == 32 ? 0xFFFFFFFFUL : (1UL << count) - 1;
+    while (remaining != 0) {
+        uint8_t best = 0, bestCost = 0xFF;
+        for (i = 0; i < count; i++) {
+            uint8_t cost;
+            if (!(remaining & (1UL << i)) || (overlaps[i] & remaining)) { continue; }
+            cost = DeferredCost(&g_Inst.deferredDraws[i]);
+            if (cost < bestCost) {
+                best = i;
+                bestCost = cost;
+                if (cost == 0) { break; }
+            }
+        }
+        SendDeferredDraw(&g_Inst.deferredDraws[best]);
+        remaining &= ~(1UL << best);
+    }
+    g_Inst.deferredCount = 0;
+    g_Inst.deferredTextUsed = 0;
+
+    // Whatever comes next expects the state the application set
+    WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).colorRGB, g_Inst.deferredState.colorRGB);
+    WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).colorAlpha, g_Inst.deferredState.colorAlpha);
+    WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).tag, g_Inst.deferredState.tag);
+    FTGLCmdFGColor(g_Inst.deferredState.fgColor);
+    FTGLCmdGradColor(g_Inst.deferredState.gradColor);
+
+    g_Inst.deferring = wasDeferring;
+}
+#endif
+
 //// Vertex lists:
 // Start a vertex list to render the given primitive type.
 // Types are FT_POINTS, FT_BITMAPS, FT_LINES,
 // FT_LINE_STRIP, FT_EDGE_STRIP_R, FT_EDGE_STRIP_L, 
 // FT_EDGE_STRIP_A, FT_EDGE_STRIP_B, FT_RECTS
-void FTGLBegin(uint8_t primitiveType) { DLCommand(FT_BEGIN(primitiveType)); }
+void FTGLBegin(uint8_t primitiveType) { WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).primitive, FT_BEGIN(primitiveType)); }
 void FTGLVertex2ii(uint16_t x, uint16_t y, uint8_t handle, uint8_t cell) { DLCommand(FT_VERTEX2II(x, y, handle, cell)); }
 void FTGLVertex2f(uint16_t x, uint16_t y) { DLCommand(FT_VERTEX2F(x, y)); }
+
+// Vertices are packed this many at a time, so each group needs one space
+// check and one write
+#define VERTEX_GROUP 64
+
+// Packs count vertices into words, already in FT800 byte order. A vertex is
+// ((x & xMask) << xShift) | ((y & yMask) << yShift) | base.
+static void PackVertices(uint32_t *out, const uint16_t *x, const uint16_t *y, uint16_t count,
+                         uint32_t xMask, uint8_t xShift, uint32_t yMask, uint8_t yShift, uint32_t base) {
+    uint16_t i = 0;
+#if defined(VERTEX_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i xm = _mm_set1_epi32((int)xMask), ym = _mm_set1_epi32((int)yMask);
+    const __m128i b = _mm_set1_epi32((int)base);
+    const __m128i xs = _mm_cvtsi32_si128(xShift), ys = _mm_cvtsi32_si128(yShift);
+    for (; i + 8 <= count; i += 8) {
+        __m128i vx = _mm_loadu_si128((const __m128i*)(x + i));
+        __m128i vy = _mm_loadu_si128((const __m128i*)(y + i));
+        __m128i lo = _mm_or_si128(_mm_sll_epi32(_mm_and_si128(_mm_unpacklo_epi16(vx, zero), xm), xs),
+                                  _mm_sll_epi32(_mm_and_si128(_mm_unpacklo_epi16(vy, zero), ym), ys));
+        __m128i hi = _mm_or_si128(_mm_sll_epi32(_mm_and_si128(_mm_unpackhi_epi16(vx, zero), xm), xs),
+                                  _mm_sll_epi32(_mm_and_si128(_mm_unpackhi_epi16(vy, zero), ym), ys));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(lo, b));
+        _mm_storeu_si128((__m128i*)(out + i + 4), _mm_or_si128(hi, b));
+    }
+#elif defined(VERTEX_NEON)
+    const uint32x4_t xm = vdupq_n_u32(xMask), ym = vdupq_n_u32(yMask), b = vdupq_n_u32(base);
+    const int32x4_t xs = vdupq_n_s32(xShift), ys = vdupq_n_s32(yShift);
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t vx = vld1q_u16(x + i);
+        uint16x8_t vy = vld1q_u16(y + i);
+        uint32x4_t lo = vorrq_u32(vshlq_u32(vandq_u32(vmovl_u16(vget_low_u16(vx)), xm), xs),
+                                  vshlq_u32(vandq_u32(vmovl_u16(vget_low_u16(vy)), ym), ys));
+        uint32x4_t hi = vorrq_u32(vshlq_u32(vandq_u32(vmovl_u16(vget_high_u16(vx)), xm), xs),
+                                  vshlq_u32(vandq_u32(vmovl_u16(vget_high_u16(vy)), ym), ys));
+        vst1q_u32(out + i, vorrq_u32(lo, b));
+        vst1q_u32(out + i + 4, vorrq_u32(hi, b));
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = HOST_TO_FT_ULONG(((x[i] & xMask) << xShift) | ((y[i] & yMask) << yShift) | base);
+    }
+}
+
+static void VertexArray(const uint16_t *x, const uint16_t *y, uint16_t count,
+                        uint32_t xMask, uint8_t xShift, uint32_t yMask, uint8_t yShift, uint32_t base) {
+    uint32_t words[VERTEX_GROUP];
+    while (count > 0) {
+        uint16_t n = count < VERTEX_GROUP ? count : VERTEX_GROUP;
+        PackVertices(words, x, y, n, xMask, xShift, yMask, yShift, base);
+        EnsureSpace(n * sizeof(uint32_t));
+        AppendBytes((const uint8_t*)words, n * sizeof(uint32_t));
+        x += n;
+        y += n;
+        count -= n;
+    }
+}
+
+void FTGLVertex2fArray(const uint16_t *x, const uint16_t *y, uint16_t count) {
+    VertexArray(x, y, count, 32767UL, 15, 32767UL, 0, FT_VERTEX2F(0, 0));
+}
+
+void FTGLVertex2iiArray(const uint16_t *x, const uint16_t *y, uint8_t handle, uint8_t cell, uint16_t count) {
+    VertexArray(x, y, count, 511UL, 21, 511UL, 12, FT_VERTEX2II(0, 0, handle, cell));
+}
 void FTGLEnd(void) { /* Intentionally empty */ }
 
 //// Bitmaps:
@@ -605,12 +1885,160 @@ void FTGLBitmapCell(uint8_t cell) { WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).bitmapC
 // Used to apply scaling, rotation, shearing, etc
 // All values are 8.8 signed fixed point (17 bits total)
 
-void FTGLBitmapTransformA(uint32_t a) { DLCommand(FT_BITMAP_TRANSFORM_A(a)); }
-void FTGLBitmapTransformB(uint32_t b) { DLCommand(FT_BITMAP_TRANSFORM_B(b)); }
-void FTGLBitmapTransformC(uint32_t c) { DLCommand(FT_BITMAP_TRANSFORM_C(c)); }
-void FTGLBitmapTransformD(uint32_t d) { DLCommand(FT_BITMAP_TRANSFORM_D(d)); }
-void FTGLBitmapTransformE(uint32_t e) { DLCommand(FT_BITMAP_TRANSFORM_E(e)); }
-void FTGLBitmapTransformF(uint32_t f) { DLCommand(FT_BITMAP_TRANSFORM_F(f)); }
+#if FTGL_CACHE_GRAPHICS_CONTEXT == 1
+// Transform values are only sent once something else is, and only if they
+// are still different from what the FT800 has then.
+static void SetTransform(BitmapTransformIndex index, uint32_t value) {
+    uint8_t bit = (uint8_t)(1 << index);
+    // Held draws were made with the old transform
+    DEFER_BARRIER();
+    if (GRAPHICS_CONTEXT(g_Inst).bitmapTransform[index] == value) {
+        g_Inst.transformPending &= (uint8_t)~bit;
+    } else {
+        g_Inst.transformValues[index] = value;
+        g_Inst.transformPending |= bit;
+    }
+}
+
+static void FlushTransforms(void) {
+    uint8_t i, count = 0;
+    for (i = 0; i < 6; i++) {
+        count += (g_Inst.transformPending >> i) & 1;
+    }
+    if (g_Inst.cmdQueueFreeSpace < count * sizeof(uint32_t)) {
+        WaitForSpace(count * sizeof(uint32_t));
+    }
+    for (i = 0; i < 6; i++) {
+        if (g_Inst.transformPending & (1 << i)) {
+            GRAPHICS_CONTEXT(g_Inst).bitmapTransform[i] = g_Inst.transformValues[i];
+            Append32(g_Inst.transformValues[i]);
+        }
+    }
+    g_Inst.transformPending = 0;
+}
+
+// Makes the cached transform unknown, or the identity
+static void SetTransformIdentity(int identity) {
+    uint32_t *t = GRAPHICS_CONTEXT(g_Inst).bitmapTransform;
+    if (identity) {
+        t[BMP_TRANSFORM_A] = FT_BITMAP_TRANSFORM_A(256);
+        t[BMP_TRANSFORM_B] = FT_BITMAP_TRANSFORM_B(0);
+        t[BMP_TRANSFORM_C] = FT_BITMAP_TRANSFORM_C(0);
+        t[BMP_TRANSFORM_D] = FT_BITMAP_TRANSFORM_D(0);
+        t[BMP_TRANSFORM_E] = FT_BITMAP_TRANSFORM_E(256);
+        t[BMP_TRANSFORM_F] = FT_BITMAP_TRANSFORM_F(0);
+    } else {
+        memset(t, 0xFF, sizeof(GRAPHICS_CONTEXT(g_Inst).bitmapTransform));
+    }
+}
+#else
+#define SetTransform(index, value) DLCommand(value)
+#endif
+
+void FTGLBitmapTransformA(uint32_t a) { SetTransform(BMP_TRANSFORM_A, FT_BITMAP_TRANSFORM_A(a)); }
+void FTGLBitmapTransformB(uint32_t b) { SetTransform(BMP_TRANSFORM_B, FT_BITMAP_TRANSFORM_B(b)); }
+void FTGLBitmapTransformC(uint32_t c) { SetTransform(BMP_TRANSFORM_C, FT_BITMAP_TRANSFORM_C(c)); }
+void FTGLBitmapTransformD(uint32_t d) { SetTransform(BMP_TRANSFORM_D, FT_BITMAP_TRANSFORM_D(d)); }
+void FTGLBitmapTransformE(uint32_t e) { SetTransform(BMP_TRANSFORM_E, FT_BITMAP_TRANSFORM_E(e)); }
+void FTGLBitmapTransformF(uint32_t f) { SetTransform(BMP_TRANSFORM_F, FT_BITMAP_TRANSFORM_F(f)); }
+
+//// Host matrix
+
+// sin(x) for a quarter turn in 64 steps, scaled by 32768
+static const uint16_t sineTable[65] PROGMEM = {
+    0, 804, 1608, 2411, 3212, 4011, 4808, 5602, 6393, 7180, 7962, 8740, 9512,
+    10279, 11039, 11793, 12540, 13279, 14010, 14733, 15447, 16151, 16846,
+    17531, 18205, 18868, 19520, 20160, 20788, 21403, 22006, 22595, 23170,
+    23732, 24279, 24812, 25330, 25833, 26320, 26791, 27246, 27684, 28106,
+    28511, 28899, 29269, 29622, 29957, 30274, 30572, 30853, 31114, 31357,
+    31581, 31786, 31972, 32138, 32286, 32413, 32522, 32610, 32679, 32729,
+    32758, 32768
+};
+
+// Returns the sine of a (65536 to a turn) in 16.16 fixed point
+static int32_t Sine16(uint16_t a) {
+    uint16_t i = a & 0x3FFF;
+    int32_t lo, hi, v;
+    if (a & 0x4000) { i = 0x4000 - i; } // The second and fourth quarters run backwards
+    if (i == 0x4000) {
+        v = 65536;
+    } else {
+        lo = SINE_TABLE(i >> 8);
+        hi = SINE_TABLE((i >> 8) + 1);
+        v = (lo + (((hi - lo) * (int32_t)(i & 0xFF)) >> 8)) * 2;
+    }
+    return (a & 0x8000) ? -v : v;
+}
+
+// a * b in 16.16 fixed point
+static int32_t MulFixed(int32_t a, int32_t b) {
+    return (int32_t)(((int64_t)a * b) >> 16);
+}
+
+#define CURRENT_MATRIX (g_Inst.matrix[g_Inst.matrixIndex])
+
+void FTGLLoadIdentity(void) {
+    HostMatrix *m = &CURRENT_MATRIX;
+    m->a = 65536; m->b = 0; m->c = 0;
+    m->d = 0; m->e = 65536; m->f = 0;
+}
+
+// Each operation is applied to the bitmap before the ones already in the
+// matrix, so its inverse goes on the screen side of the inverse matrix.
+void FTGLTranslate(int32_t tx, int32_t ty) {
+    CURRENT_MATRIX.c -= tx;
+    CURRENT_MATRIX.f -= ty;
+}
+
+void FTGLScale(int32_t sx, int32_t sy) {
+    HostMatrix *m = &CURRENT_MATRIX;
+    if (sx == 0 || sy == 0) { return; }
+    m->a = (int32_t)((int64_t)m->a * 65536 / sx);
+    m->b = (int32_t)((int64_t)m->b * 65536 / sx);
+    m->c = (int32_t)((int64_t)m->c * 65536 / sx);
+    m->d = (int32_t)((int64_t)m->d * 65536 / sy);
+    m->e = (int32_t)((int64_t)m->e * 65536 / sy);
+    m->f = (int32_t)((int64_t)m->f * 65536 / sy);
+}
+
+void FTGLRotate(int32_t a) {
+    HostMatrix *m = &CURRENT_MATRIX;
+    HostMatrix r = *m;
+    int32_t s = Sine16((uint16_t)a);
+    int32_t c = Sine16((uint16_t)(a + 0x4000));
+    m->a = MulFixed(c, r.a) + MulFixed(s, r.d);
+    m->b = MulFixed(c, r.b) + MulFixed(s, r.e);
+    m->c = MulFixed(c, r.c) + MulFixed(s, r.f);
+    m->d = MulFixed(c, r.d) - MulFixed(s, r.a);
+    m->e = MulFixed(c, r.e) - MulFixed(s, r.b);
+    m->f = MulFixed(c, r.f) - MulFixed(s, r.c);
+}
+
+// The bitmap transform is 8.8 for A, B, D and E, and 15.8 for C and F
+#define FIXED_TO_TRANSFORM(v) ((uint32_t)(((v) + 128) >> 8))
+
+void FTGLSetMatrix(void) {
+    HostMatrix *m = &CURRENT_MATRIX;
+    FTGLBitmapTransformA(FIXED_TO_TRANSFORM(m->a));
+    FTGLBitmapTransformB(FIXED_TO_TRANSFORM(m->b));
+    FTGLBitmapTransformC(FIXED_TO_TRANSFORM(m->c));
+    FTGLBitmapTransformD(FIXED_TO_TRANSFORM(m->d));
+    FTGLBitmapTransformE(FIXED_TO_TRANSFORM(m->e));
+    FTGLBitmapTransformF(FIXED_TO_TRANSFORM(m->f));
+}
+
+int FTGLPushMatrix(void) {
+    if (g_Inst.matrixIndex + 1 > FTGL_MATRIX_STACK_DEPTH) { return -1; }
+    g_Inst.matrixIndex++;
+    CURRENT_MATRIX = g_Inst.matrix[g_Inst.matrixIndex - 1];
+    return 0;
+}
+
+int FTGLPopMatrix(void) {
+    if (g_Inst.matrixIndex == 0) { return -1; }
+    g_Inst.matrixIndex--;
+    return 0;
+}
 
 //// FUNC and CLEAR values
 void FTGLAlphaFunc(uint8_t func, uint8_t refValue) { WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).alphaFunc, FT_ALPHA_FUNC(func, refValue)); }
@@ -629,34 +2057,567 @@ void FTGLClear(ClearFlags flags) { DLCommand(FT_CLEAR32(flags)); }
 
 //// Current Colors (these are the colors used when drawing primitives
 #define FT_COLOR_RGB32(color) ((4UL<<24)|color)
-void FTGLColorA(uint8_t alpha) { WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).colorAlpha, alpha); }
-void FTGLColorRGB(uint32_t color) { WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).colorRGB, FT_COLOR_RGB32(color)); }
-void FTGLColorRGBComponents(uint8_t r, uint8_t g, uint8_t b) { WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).colorRGB, FT_COLOR_RGB(r, g, b)); }
+void FTGLColorA(uint8_t alpha) { WRITE_STATE(colorAlpha, FT_COLOR_A(alpha)); }
+void FTGLColorRGB(uint32_t color) { WRITE_STATE(colorRGB, FT_COLOR_RGB32(color)); }
+void FTGLColorRGBComponents(uint8_t r, uint8_t g, uint8_t b) { WRITE_STATE(colorRGB, FT_COLOR_RGB(r, g, b)); }
+
+#define FT_COLOR_MASK32(flags) ((32UL<<24)|flags)
+void FTGLColorMask(MaskFlags flags) { WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).colorMask, FT_COLOR_MASK32(flags)); }
+
+//// Control flow
+// Ends the display list
+void FTGLDisplay(void) { DLCommand(FT_DISPLAY()); }
+void FTGLCall(uint16_t dest) { DLCommand(FT_CALL(dest)); }
+void FTGLReturn(void) { DLCommand(FT_RETURN()); }
+void FTGLMacro(uint8_t m) {
+    DLCommand(FT_MACRO(m));
+    // The macro may hold any command, so nothing about the graphics state
+    // is known after it.
+    InvalidateGraphicsContext();
+}
+
+void FTGLSetMacro(uint8_t m, uint32_t dlCommand) {
+    uint8_t bit = 1 << (m & 1);
+    m &= 1;
+    if ((g_Inst.macroKnown & bit) && g_Inst.macroValues[m] == dlCommand) {
+        return;
+    }
+    g_Inst.macroValues[m] = dlCommand;
+    g_Inst.macroKnown |= bit;
+
+    g_Inst.macroPending |= bit;
+    if (!g_Inst.inFrame) {
+        // Also writes any value still waiting for the last frame's swap
+        WritePendingMacros();
+    }
+}
+
+//// Context Saving
+#if FTGL_CACHE_GRAPHICS_CONTEXT == 1 && FTGL_CONTEXT_STACK_DEPTH > 0
+// Every value in GraphicsContext is a display list command, so they can be
+// walked as an array of words. The primitive is last, and is not part of
+// the FT800's context.
+#define CONTEXT_WORDS(ctx) ((uint32_t*)&(ctx))
+#define CONTEXT_STATE_WORDS (sizeof(GraphicsContext) / sizeof(uint32_t) - 1)
+
+static int ContextKnown(GraphicsContext *ctx) {
+    uint8_t i;
+    for (i = 0; i < CONTEXT_STATE_WORDS; i++) {
+        if (CONTEXT_WORDS(*ctx)[i] == 0xFFFFFFFFUL) { return 0; }
+    }
+    return 1;
+}
+#endif
+
+// With the graphics context cache, saving is done on the host when the whole
+// context is known, and restoring then only sends the values that changed.
+// SAVE_CONTEXT and RESTORE_CONTEXT are used when something is not known, or
+// the host stack is full.
+void FTGLSaveContext(void) {
+#if FTGL_CACHE_GRAPHICS_CONTEXT == 1 && FTGL_CONTEXT_STACK_DEPTH > 0
+    uint16_t bit;
+    // The saved context includes any state and transform set before this
+    DEFER_BARRIER();
+    FLUSH_TRANSFORMS();
+    if (g_Inst.contextOverflow == 0 && g_Inst.contextStackIndex < FTGL_CONTEXT_STACK_DEPTH) {
+        int known = ContextKnown(&GRAPHICS_CONTEXT(g_Inst));
+        g_Inst.contextStackIndex++;
+        g_Inst.graphicsContext[g_Inst.contextStackIndex] = g_Inst.graphicsContext[g_Inst.contextStackIndex - 1];
+        bit = (uint16_t)(1U << g_Inst.contextStackIndex);
+        if (known) {
+            g_Inst.contextHardware &= (uint16_t)~bit;
+            return;
+        }
+        g_Inst.contextHardware |= bit;
+    } else if (g_Inst.contextOverflow < 0xFF) {
+        g_Inst.contextOverflow++;
+    }
+#endif
+    DLCommand(FT_SAVE_CONTEXT());
+}
+
+void FTGLRestoreContext(void) {
+#if FTGL_CACHE_GRAPHICS_CONTEXT == 1
+    uint32_t primitive;
+    // Anything set since the save is replaced by the restored values
+    DEFER_BARRIER();
+    g_Inst.transformPending = 0;
+    primitive = GRAPHICS_CONTEXT(g_Inst).primitive;
+#if FTGL_CONTEXT_STACK_DEPTH > 0
+    if (g_Inst.contextOverflow == 0 && g_Inst.contextStackIndex > 0) {
+        uint8_t level = g_Inst.contextStackIndex;
+        if (g_Inst.contextHardware & (1U << level)) {
+            DLCommand(FT_RESTORE_CONTEXT());
+        } else {
+            uint32_t *current = CONTEXT_WORDS(g_Inst.graphicsContext[level]);
+            uint32_t *saved = CONTEXT_WORDS(g_Inst.graphicsContext[level - 1]);
+            uint8_t i;
+            for (i = 0; i < CONTEXT_STATE_WORDS; i++) {
+                if (current[i] != saved[i]) { DLCommand(saved[i]); }
+            }
+        }
+        g_Inst.contextStackIndex--;
+    } else {
+        if (g_Inst.contextOverflow > 0) { g_Inst.contextOverflow--; }
+        DLCommand(FT_RESTORE_CONTEXT());
+        InvalidateGraphicsContext();
+    }
+#else
+    DLCommand(FT_RESTORE_CONTEXT());
+    InvalidateGraphicsContext();
+#endif
+    // BEGIN is not part of the context
+    GRAPHICS_CONTEXT(g_Inst).primitive = primitive;
+#if FTGL_DEFERRED_DRAWS > 0
+    g_Inst.deferredState.colorRGB = GRAPHICS_CONTEXT(g_Inst).colorRGB;
+    g_Inst.deferredState.colorAlpha = GRAPHICS_CONTEXT(g_Inst).colorAlpha;
+    g_Inst.deferredState.tag = GRAPHICS_CONTEXT(g_Inst).tag;
+#endif
+#else
+    DLCommand(FT_RESTORE_CONTEXT());
+#endif
+}
+
+//// Recorded segments
+int FTGLCreateSegment(void) {
+    if (g_Inst.segmentCount >= FTGL_MAX_SEGMENTS) { return -1; }
+    return g_Inst.segmentCount++;
+}
+
+static int SegmentValid(int segmentId) {
+    return segmentId >= 0 && segmentId < g_Inst.segmentCount;
+}
+
+// Waits for the coprocessor to finish everything written so far and returns
+// its offset into RAM_DL.
+static uint32_t SyncDisplayListOffset(void) {
+    uint32_t offset;
+    DEFER_BARRIER();
+    EndAppend();
+    PublishCommands();
+    WaitForQueueEmpty();
+    offset = ReadReg16(FT_REG_CMD_DL);
+    BeginAppend();
+    return offset;
+}
+
+void FTGLBeginRecord(int segmentId) {
+    if (g_Inst.recordingSegment >= 0 || !SegmentValid(segmentId)) { return; }
+    g_Inst.recordingSegment = (int16_t)segmentId;
+    g_Inst.segments[segmentId].size = 0;
+    g_Inst.recordStart = SyncDisplayListOffset();
+
+    // The recording has to set everything it depends on, since it does not
+    // know what will come before it when it is replayed.
+    InvalidateGraphicsContext();
+    InvalidateBitmapHandles();
+}
+
+int FTGLEndRecord(void) {
+    Segment *segment;
+    uint32_t size;
+
+    if (g_Inst.recordingSegment < 0) { return -1; }
+    segment = &g_Inst.segments[g_Inst.recordingSegment];
+    g_Inst.recordingSegment = -1;
+    size = SyncDisplayListOffset() - g_Inst.recordStart;
+
+    if (size > segment->capacity) {
+        uint32_t address;
+        if (segment->capacity > 0) {
+            FreeRam(segment->address);
+            segment->capacity = 0;
+        }
+        address = AllocateRam(size, RAM_OWNER_SEGMENT, (int16_t)(segment - g_Inst.segments));
+        if (address == FTGL_RAM_NONE) {
+            return -1;
+        }
+        segment->address = address;
+        segment->capacity = size;
+    }
+
+    // The commands are still in RAM_DL, and this copy runs before
+    // anything after it can overwrite them
+    EnsureSpace(sizeof(uint32_t) * 4);
+    Append32(FT_CMD_MEMCPY);
+    Append32(segment->address);
+    Append32(FT_RAM_DL + g_Inst.recordStart);
+    Append32(size);
+
+    segment->size = size;
+    return (int)size;
+}
+
+int FTGLSegmentRecorded(int segmentId) {
+    return SegmentValid(segmentId) && g_Inst.segments[segmentId].size > 0;
+}
+
+void FTGLReplay(int segmentId) {
+    if (!SegmentValid(segmentId) || g_Inst.segments[segmentId].size == 0) { return; }
+    EnsureSpace(sizeof(uint32_t) * 3);
+    Append32(FT_CMD_APPEND);
+    Append32(g_Inst.segments[segmentId].address);
+    Append32(g_Inst.segments[segmentId].size);
+
+    // The recording changes state behind the cache's back
+    InvalidateGraphicsContext();
+    InvalidateBitmapHandles();
+}
+
+//// Command stream optimizer
+
+// Sizes of the coprocessor commands in bytes, including the command itself,
+// indexed by the low byte of the command. Commands ending in a string list
+// the size before the string. 0 means the size can not be known without
+// running the command.
+#define OPT_NUM_CMDS 0x35
+static const uint8_t optCommandSizes[OPT_NUM_CMDS] = {
+    4,  4,  8,  0,  0,  0,  0,  0,  0,  8,  8, 20, 12, 16, 16, 20, // 00-0F
+    20, 20, 16, 20, 20, 8, 12,  4, 16, 12, 12, 16, 12, 16, 12,  8, // 10-1F
+    0,  0,  0,  8,  0, 16,  4, 12, 12,  8,  4, 12, 16, 16, 16,  4, // 20-2F
+    20, 4,  4, 28,  8                                              // 30-34
+};
+
+#define OPT_DELETED   0xFFFFFFFFUL // Marks a removed display list command
+#define OPT_UNKNOWN   0xFFFFFFFFUL // No display list command is all ones
+#define OPT_STATE_OPS 0x21         // Display list opcodes below COLOR_MASK + 1
+
+static uint32_t OptRead32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void OptDelete(uint8_t *p) {
+    memset(p, 0xFF, sizeof(uint32_t));
+}
+
+// Returns the size of the coprocessor command at p, or 0 if it is not known
+static uint32_t OptCommandSize(const uint8_t *p, uint32_t remaining) {
+    uint8_t cmd = p[0];
+    uint32_t size;
+
+    if (cmd >= OPT_NUM_CMDS || optCommandSizes[cmd] == 0) { return 0; }
+    size = optCommandSizes[cmd];
+
+    if (cmd == (FT_CMD_TEXT & 0xFF) || cmd == (FT_CMD_BUTTON & 0xFF) ||
+        cmd == (FT_CMD_KEYS & 0xFF) || cmd == (FT_CMD_TOGGLE & 0xFF)) {
+        while (size < remaining && p[size] != '\0') { size++; }
+        size = (size + 4) & ~3UL; // The terminator and padding
+    } else if (cmd == (FT_CMD_MEMWRITE & 0xFF)) {
+        if (remaining < size) { return 0; }
+        size += (OptRead32(p + 8) + 3) & ~3UL;
+    }
+    return size <= remaining ? size : 0;
+}
+
+// Coprocessor commands that do not add anything to the display list
+static int OptNeutralCommand(uint8_t cmd) {
+    return cmd == (FT_CMD_BGCOLOR & 0xFF) || cmd == (FT_CMD_FGCOLOR & 0xFF) ||
+           cmd == (FT_CMD_GRADCOLOR & 0xFF) || cmd == (FT_CMD_LOADIDENTITY & 0xFF) ||
+           cmd == (FT_CMD_TRANSLATE & 0xFF) || cmd == (FT_CMD_SCALE & 0xFF) ||
+           cmd == (FT_CMD_ROTATE & 0xFF) || cmd == (FT_CMD_INTERRUPT & 0xFF);
+}
+
+static int OptStateOp(uint8_t op) {
+    return (op >= 0x02 && op <= 0x06) || (op >= 0x09 && op <= 0x1C) || op == 0x20;
+}
+
+typedef struct {
+    uint32_t value[OPT_STATE_OPS];   // Known value of each state command
+    uint32_t pending[OPT_STATE_OPS]; // Offset + 1 of a write nothing has used yet
+    uint16_t handleWidth[32], handleHeight[32]; // From BITMAP_SIZE, 0 if not known
+    uint32_t primitive;    // Last BEGIN, or OPT_UNKNOWN
+    uint32_t beginOffset;  // Offset + 1 of that BEGIN, if it could still be removed
+    uint32_t endOffset;    // Offset + 1 of an END after it
+    uint32_t pairOffset;   // Offset + 1 of the first vertex of a LINES/RECTS pair
+    uint8_t pairHalf;      // A LINES/RECTS pair is half drawn
+    int32_t pairBox[4];
+    uint16_t vertices;     // Vertices drawn since the BEGIN
+} OptState;
+
+static void OptUseAll(OptState *st) {
+    memset(st->pending, 0, sizeof(st->pending));
+}
+
+// Something the optimizer does not follow may have changed any of the state
+static void OptForgetAll(OptState *st) {
+    OptUseAll(st);
+    memset(st->value, 0xFF, sizeof(st->value));
+    memset(st->handleWidth, 0, sizeof(st->handleWidth));
+    memset(st->handleHeight, 0, sizeof(st->handleHeight));
+    st->primitive = OPT_UNKNOWN;
+    st->beginOffset = 0;
+    st->endOffset = 0;
+    st->pairOffset = 0;
+    st->pairHalf = 0;
+}
+
+// Every display list starts with the default graphics state
+static void OptSetDefaults(OptState *st) {
+    OptForgetAll(st);
+    st->value[0x02] = FT_CLEAR_COLOR_RGB(0, 0, 0);
+    st->value[0x03] = FT_TAG(255);
+    st->value[0x04] = FT_COLOR_RGB(255, 255, 255);
+    st->value[0x05] = FT_BITMAP_HANDLE(0);
+    st->value[0x06] = FT_CELL(0);
+    st->value[0x09] = FT_ALPHA_FUNC(FT_ALWAYS, 0);
+    st->value[0x0A] = FT_STENCIL_FUNC(FT_ALWAYS, 0, 255);
+    st->value[0x0B] = FT_BLEND_FUNC(FT_SRC_ALPHA, FT_ONE_MINUS_SRC_ALPHA);
+    st->value[0x0C] = FT_STENCIL_OP(FT_KEEP, FT_KEEP);
+    st->value[0x0D] = FT_POINT_SIZE(16);
+    st->value[0x0E] = FT_LINE_WIDTH(16);
+    st->value[0x0F] = FT_CLEAR_COLOR_A(0);
+    st->value[0x10] = FT_COLOR_A(255);
+    st->value[0x11] = FT_CLEAR_STENCIL(0);
+    st->value[0x12] = FT_CLEAR_TAG(0);
+    st->value[0x13] = FT_STENCIL_MASK(255);
+    st->value[0x14] = FT_TAG_MASK(1);
+    st->value[0x15] = FT_BITMAP_TRANSFORM_A(256);
+    st->value[0x16] = FT_BITMAP_TRANSFORM_B(0);
+    st->value[0x17] = FT_BITMAP_TRANSFORM_C(0);
+    st->value[0x18] = FT_BITMAP_TRANSFORM_D(0);
+    st->value[0x19] = FT_BITMAP_TRANSFORM_E(256);
+    st->value[0x1A] = FT_BITMAP_TRANSFORM_F(0);
+    st->value[0x1B] = FT_SCISSOR_XY(0, 0);
+    st->value[0x1C] = FT_SCISSOR_SIZE(512, 512);
+    st->value[0x20] = FT_COLOR_MASK(1, 1, 1, 1);
+}
+
+// Returns true if the box (in pixels, right and bottom exclusive) is known
+// to be entirely outside of the scissor rectangle
+static int OptOutsideScissor(const OptState *st, const int32_t box[4]) {
+    uint32_t xy = st->value[0x1B], size = st->value[0x1C];
+    int32_t x, y;
+    if (xy == OPT_UNKNOWN || size == OPT_UNKNOWN) { return 0; }
+    x = (xy >> 9) & 511;
+    y = xy & 511;
+    return box[2] <= x || box[0] >= x + (int32_t)((size >> 10) & 1023) ||
+           box[3] <= y || box[1] >= y + (int32_t)(size & 1023);
+}
+
+// Finds the area a vertex may draw in, for the primitives that can be culled
+// one vertex (or pair) at a time. Returns false if it is not known.
+static int OptVertexBox(const OptState *st, uint32_t w, int32_t box[4]) {
+    uint8_t prim = (uint8_t)(st->primitive & 0xF);
+    int32_t x, y, r;
+    uint8_t handle;
+
+    if (st->primitive == OPT_UNKNOWN) { return 0; }
+    if ((w >> 30) == 1) {
+        // VERTEX2F is in 1/16 pixels, with signed 15 bit coordinates
+        x = (int32_t)((w >> 15) & 0x7FFF);
+        y = (int32_t)(w & 0x7FFF);
+        if (x & 0x4000) { x -= 0x8000; }
+        if (y & 0x4000) { y -= 0x8000; }
+        x >>= 4;
+        y >>= 4;
+        if (st->value[0x05] == OPT_UNKNOWN) { handle = 0xFF; }
+        else { handle = (uint8_t)(st->value[0x05] & 31); }
+    } else {
+        x = (w >> 21) & 511;
+        y = (w >> 12) & 511;
+        handle = (w >> 7) & 31;
+    }
+
+    if (prim == FT_POINTS) {
+        if (st->value[0x0D] == OPT_UNKNOWN) { return 0; }
+        r = (int32_t)((st->value[0x0D] & 8191) >> 4) + 1;
+    } else if (prim == FT_LINES || prim == FT_RECTS) {
+        if (st->value[0x0E] == OPT_UNKNOWN) { return 0; }
+        r = (int32_t)((st->value[0x0E] & 4095) >> 4) + 1;
+    } else if (prim == FT_BITMAPS) {
+        if (handle == 0xFF || st->handleWidth[handle] == 0) { return 0; }
+        box[0] = x;
+        box[1] = y;
+        box[2] = x + st->handleWidth[handle];
+        box[3] = y + st->handleHeight[handle];
+        return 1;
+    } else {
+        return 0;
+    }
+    box[0] = x - r;
+    box[1] = y - r;
+    box[2] = x + r + 1;
+    box[3] = y + r + 1;
+    return 1;
+}
+
+// One pass over the commands, marking what can be removed. Returns true if
+// anything was.
+static int OptimizePass(uint8_t *commands, uint32_t count) {
+    OptState st;
+    uint32_t offset = 0;
+    int changed = 0;
+
+    OptForgetAll(&st);
+    while (offset + sizeof(uint32_t) <= count) {
+        uint8_t *p = commands + offset;
+        uint32_t w = OptRead32(p);
+        uint8_t op = (uint8_t)(w >> 24);
+
+        if (w == OPT_DELETED) {
+            offset += sizeof(uint32_t);
+            continue;
+        }
 
-#define FT_COLOR_MASK32(flags) ((32UL<<24)|flags)
-void FTGLColorMask(MaskFlags flags) { DLCommand(FT_COLOR_MASK32(flags)); }
+        if (st.pairOffset != 0 && (w >> 30) == 0) {
+            // Anything in the middle of a pair means the first vertex stays
+            st.pairOffset = 0;
+            st.vertices++;
+            st.beginOffset = 0;
+            OptUseAll(&st);
+        }
 
-//// Control flow
-// Ends the display list
-void FTGLDisplay(void) { DLCommand(FT_DISPLAY()); }
-void FTGLCall(uint16_t dest) { DLCommand(FT_CALL(dest)); }
-void FTGLReturn(void) { DLCommand(FT_RETURN()); }
-void FTGLMacro(uint8_t m) { DLCommand(FT_MACRO(m)); }
+        if ((w & 0xFFFFFF00UL) == 0xFFFFFF00UL) {
+            uint32_t size = OptCommandSize(p, count - offset);
+            if (size == 0) { break; } // Leave the rest alone
+            if (w == FT_CMD_DLSTART) {
+                OptSetDefaults(&st);
+            } else if (!OptNeutralCommand(p[0])) {
+                OptForgetAll(&st);
+            }
+            offset += size;
+            continue;
+        }
 
-//// Context Saving
-void FTGLSaveContext(void) {
-#if FTGL_CACHE_GRAPHICS_CONTEXT && FTGL_CONTEXT_STACK_DEPTH > 0
-    g_Inst.contextStackIndex++;
-    g_Inst.graphicsContext[g_Inst.contextStackIndex] = g_Inst.graphicsContext[g_Inst.contextStackIndex - 1];
-#endif
-    DLCommand(FT_SAVE_CONTEXT());
-}
+        if ((w >> 30) != 0) {
+            // A vertex
+            uint8_t prim = (uint8_t)(st.primitive & 0xF);
+            int32_t box[4];
+            int known = OptVertexBox(&st, w, box);
+
+            if (st.primitive != OPT_UNKNOWN && (prim == FT_LINES || prim == FT_RECTS)) {
+                // These draw in pairs, so only a whole pair can be culled
+                st.pairHalf = !st.pairHalf;
+                if (st.pairHalf && known) {
+                    st.pairOffset = offset + 1;
+                    memcpy(st.pairBox, box, sizeof(box));
+                    offset += sizeof(uint32_t);
+                    continue;
+                } else if (!st.pairHalf && st.pairOffset != 0 && known) {
+                    if (box[0] > st.pairBox[0]) { box[0] = st.pairBox[0]; }
+                    if (box[1] > st.pairBox[1]) { box[1] = st.pairBox[1]; }
+                    if (box[2] < st.pairBox[2]) { box[2] = st.pairBox[2]; }
+                    if (box[3] < st.pairBox[3]) { box[3] = st.pairBox[3]; }
+                    if (OptOutsideScissor(&st, box)) {
+                        OptDelete(commands + st.pairOffset - 1);
+                        OptDelete(p);
+                        st.pairOffset = 0;
+                        changed = 1;
+                        offset += sizeof(uint32_t);
+                        continue;
+                    }
+                }
+                if (st.pairOffset != 0) { st.vertices++; }
+                st.pairOffset = 0;
+            } else if (known && OptOutsideScissor(&st, box)) {
+                OptDelete(p); // A culled vertex does not use any state
+                changed = 1;
+                offset += sizeof(uint32_t);
+                continue;
+            }
+
+            OptUseAll(&st);
+            st.vertices++;
+            st.beginOffset = 0;
+            offset += sizeof(uint32_t);
+            continue;
+        }
 
-void FTGLRestoreContext(void) {
-#if FTGL_CACHE_GRAPHICS_CONTEXT && FTGL_CONTEXT_STACK_DEPTH > 0
-    g_Inst.contextStackIndex--;
-#endif
-    DLCommand(FT_RESTORE_CONTEXT());
+        if (op < OPT_STATE_OPS && OptStateOp(op)) {
+            if (st.value[op] == w) {
+                OptDelete(p); // Already in effect
+                changed = 1;
+            } else {
+                if (st.pending[op] != 0) {
+                    OptDelete(commands + st.pending[op] - 1); // Never used
+                    changed = 1;
+                }
+                st.pending[op] = offset + 1;
+                st.value[op] = w;
+            }
+        } else if (op == 0x1F) { // BEGIN
+            uint8_t prim = (uint8_t)(w & 0xF);
+            int mergeable = prim == FT_POINTS || prim == FT_BITMAPS ||
+                            ((prim == FT_LINES || prim == FT_RECTS) && !st.pairHalf);
+            if (st.primitive == w && mergeable) {
+                // Keep drawing with the BEGIN that is already in effect
+                OptDelete(p);
+                if (st.endOffset != 0) {
+                    OptDelete(commands + st.endOffset - 1);
+                    st.endOffset = 0;
+                }
+                changed = 1;
+            } else {
+                if (st.beginOffset != 0) {
+                    OptDelete(commands + st.beginOffset - 1); // Drew nothing
+                    changed = 1;
+                }
+                st.primitive = w;
+                st.beginOffset = offset + 1;
+                st.endOffset = 0;
+                st.pairHalf = 0;
+                st.vertices = 0;
+            }
+        } else if (op == 0x21) { // END
+            st.endOffset = offset + 1;
+        } else if (op == 0x01 || op == 0x07 || op == 0x08) {
+            // BITMAP_SOURCE, LAYOUT and SIZE apply to the current handle
+            if (op == 0x08 && st.value[0x05] != OPT_UNKNOWN) {
+                uint8_t handle = (uint8_t)(st.value[0x05] & 31);
+                st.handleWidth[handle] = (w >> 9) & 511 ? (w >> 9) & 511 : 512;
+                st.handleHeight[handle] = w & 511 ? w & 511 : 512;
+            } else if (op == 0x08) {
+                memset(st.handleWidth, 0, sizeof(st.handleWidth));
+            }
+            st.pending[0x05] = 0;
+        } else if (op == 0x26 || op == 0x22) { // CLEAR, SAVE_CONTEXT
+            OptUseAll(&st);
+            st.beginOffset = 0;
+        } else if (op == 0x23) { // RESTORE_CONTEXT does not restore BEGIN
+            uint32_t primitive = st.primitive;
+            uint8_t pairHalf = st.pairHalf;
+            OptForgetAll(&st);
+            st.primitive = primitive;
+            st.pairHalf = pairHalf;
+        } else {
+            // DISPLAY, CALL, JUMP, RETURN, MACRO and anything unknown
+            OptForgetAll(&st);
+        }
+        offset += sizeof(uint32_t);
+    }
+    return changed;
+}
+
+uint32_t FTGLOptimizeCommands(uint8_t *commands, uint32_t count) {
+    uint32_t in, out, size;
+    int passes;
+
+    count &= ~3UL;
+    // Removing commands can make others redundant, so repeat a few times
+    for (passes = 0; passes < 4; passes++) {
+        if (!OptimizePass(commands, count)) { break; }
+
+        // Squeeze out the removed commands. Coprocessor commands are copied
+        // whole, so that their parameters are not mistaken for markers.
+        in = out = 0;
+        while (in < count) {
+            uint32_t w = OptRead32(commands + in);
+            if (w == OPT_DELETED) {
+                in += sizeof(uint32_t);
+                continue;
+            }
+            size = sizeof(uint32_t);
+            if ((w & 0xFFFFFF00UL) == 0xFFFFFF00UL) {
+                size = OptCommandSize(commands + in, count - in);
+                if (size == 0) { size = count - in; }
+            }
+            memmove(commands + out, commands + in, size);
+            in += size;
+            out += size;
+        }
+        count = out;
+    }
+    return count;
 }
 
 // Primitive params
@@ -666,9 +2627,105 @@ void FTGLPointSize(uint32_t size) {  WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).pointS
 // SCISSOR, STENCIL, TAG
 void FTGLScissorSize(uint16_t width, uint16_t height) { WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).scissorSize, FT_SCISSOR_SIZE(width, height)); }
 void FTGLScissorXY(uint16_t x, uint16_t y) { WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).scissorXY, FT_SCISSOR_XY(x, y)); }
+
+#if FTGL_CLIP_STACK_DEPTH > 0
+// The setters skip values the scissor already has. The clip stack does not
+// know the scissor on its own, since a replay, macro or restored context can
+// change it.
+static void SendClip(const ClipRect *clip) {
+    FTGLScissorXY((uint16_t)clip->x0, (uint16_t)clip->y0);
+    FTGLScissorSize((uint16_t)(clip->x1 - clip->x0), (uint16_t)(clip->y1 - clip->y0));
+}
+
+// Returns true if nothing inside the box (right and bottom exclusive) can be
+// seen through the current clip. A couple of pixels are allowed for
+// antialiased edges.
+static int Clipped(int32_t x0, int32_t y0, int32_t x1, int32_t y1) {
+    const ClipRect *clip = &g_Inst.clipStack[g_Inst.clipIndex];
+    return x1 + 2 <= clip->x0 || x0 - 2 >= clip->x1 ||
+           y1 + 2 <= clip->y0 || y0 - 2 >= clip->y1;
+}
+#define CLIPPED(x0, y0, x1, y1) (g_Inst.clipIndex > 0 && Clipped(x0, y0, x1, y1))
+
+// The tallest character in each ROM font, for skipping text
+static const uint8_t romFontHeights[16] PROGMEM = {
+    8, 8, 16, 16, 13, 17, 20, 22, 29, 38, 16, 20, 25, 28, 36, 49
+};
+#if defined(ARDUINO) && defined(__AVR__)
+#define ROM_FONT_HEIGHT(f) pgm_read_byte_near(romFontHeights + (f))
+#else
+#define ROM_FONT_HEIGHT(f) romFontHeights[f]
+#endif
+
+// Text is skipped if it is entirely above, below, left or right of the clip.
+// Its width is not known, so only the side it starts from is checked.
+static int TextClipped(int16_t x, int16_t y, int16_t font, uint16_t options) {
+    const ClipRect *clip;
+    int32_t h;
+    if (g_Inst.clipIndex == 0 || font < 16 || font > 31) { return 0; }
+    clip = &g_Inst.clipStack[g_Inst.clipIndex];
+    h = ROM_FONT_HEIGHT(font - 16);
+    if (options & FT_OPT_CENTERY) { y = (int16_t)(y - h / 2); }
+    if (Clipped(-32768, y, 32767, y + h)) { return 1; }
+    if (options & FT_OPT_CENTERX) { return 0; }
+    if (options & FT_OPT_RIGHTX) { return x + 2 <= clip->x0; }
+    return x - 2 >= clip->x1;
+}
+
+// A toggle is about as tall as its font, and its knob sticks out past the
+// ends, so it is given that much room on every side
+static int ToggleClipped(int16_t x, int16_t y, int16_t w, int16_t font) {
+    int32_t h;
+    if (g_Inst.clipIndex == 0 || font < 16 || font > 31) { return 0; }
+    h = ROM_FONT_HEIGHT(font - 16);
+    return Clipped(x - h, y - h, x + w + h, y + 2 * h);
+}
+#else
+#define CLIPPED(x0, y0, x1, y1) 0
+#define TextClipped(x, y, font, options) 0
+#define ToggleClipped(x, y, w, font) 0
+#endif
+
+// Slider and scrollbar knobs stick out past the bar by up to its thickness
+#define KNOB_CLIPPED(x, y, w, h, knob) CLIPPED((x) - (knob), (y) - (knob), (x) + (w) + (knob), (y) + (h) + (knob))
+#define KNOB_SIZE(w, h) ((w) < (h) ? (w) : (h))
+
+int FTGLPushClip(int16_t x, int16_t y, int16_t w, int16_t h) {
+#if FTGL_CLIP_STACK_DEPTH > 0
+    ClipRect *parent, *clip;
+    if (g_Inst.clipIndex >= FTGL_CLIP_STACK_DEPTH) { return -1; }
+    // Held draws are clipped by the clip they were made in
+    DEFER_BARRIER();
+    parent = &g_Inst.clipStack[g_Inst.clipIndex];
+    clip = &g_Inst.clipStack[++g_Inst.clipIndex];
+    clip->x0 = x > parent->x0 ? x : parent->x0;
+    clip->y0 = y > parent->y0 ? y : parent->y0;
+    clip->x1 = x + w < parent->x1 ? (int16_t)(x + w) : parent->x1;
+    clip->y1 = y + h < parent->y1 ? (int16_t)(y + h) : parent->y1;
+    if (clip->x1 < clip->x0) { clip->x1 = clip->x0; }
+    if (clip->y1 < clip->y0) { clip->y1 = clip->y0; }
+    SendClip(clip);
+    return 0;
+#else
+    (void)x; (void)y; (void)w; (void)h;
+    return -1;
+#endif
+}
+
+int FTGLPopClip(void) {
+#if FTGL_CLIP_STACK_DEPTH > 0
+    if (g_Inst.clipIndex == 0) { return -1; }
+    DEFER_BARRIER();
+    g_Inst.clipIndex--;
+    SendClip(&g_Inst.clipStack[g_Inst.clipIndex]);
+    return 0;
+#else
+    return -1;
+#endif
+}
 void FTGLStencilFunc(uint8_t func, uint8_t ref, uint8_t mask) { WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).stencilFunc, FT_STENCIL_FUNC(func, ref, mask)); }
 void FTGLStencilOp(uint8_t sfail, uint8_t spass) { WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).stencilOp, FT_STENCIL_OP(sfail, spass)); }
-void FTGLTag(uint8_t tag) { WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).tag, FT_TAG(tag)); }
+void FTGLTag(uint8_t tag) { WRITE_STATE(tag, FT_TAG(tag)); }
 void FTGLTagMask(uint8_t on) { WRITE_DLCMD(GRAPHICS_CONTEXT(g_Inst).tagMask, FT_TAG_MASK(on)); }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -681,40 +2738,90 @@ void FTGLCmdColdStart(void) {
     g_Inst.commandContext.bgColor =   0x002040;
     g_Inst.commandContext.fgColor =   0x003870;
     g_Inst.commandContext.gradColor = 0xffffff;
+    g_Inst.commandContext.matrixIdentity = 1;
 #endif
     EnsureSpace(sizeof(uint32_t) * 2);
     Append32(FT_CMD_STOP);
     Append32(FT_CMD_COLDSTART); 
 }
+int FTGLPushCommandContext(void) {
+#if FTGL_COMMAND_STACK_DEPTH > 0
+    CoprocessorContext *saved;
+    if (g_Inst.commandStackIndex >= FTGL_COMMAND_STACK_DEPTH) { return -1; }
+    saved = &g_Inst.commandStack[g_Inst.commandStackIndex++];
+    *saved = g_Inst.commandContext;
+#if FTGL_DEFERRED_DRAWS > 0
+    // While deferring, the colors the application set are not sent yet
+    if (DEFERRING()) {
+        saved->fgColor = g_Inst.deferredState.fgColor;
+        saved->gradColor = g_Inst.deferredState.gradColor;
+    }
+#endif
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+int FTGLPopCommandContext(void) {
+#if FTGL_COMMAND_STACK_DEPTH > 0
+    CoprocessorContext *saved;
+    if (g_Inst.commandStackIndex == 0) { return -1; }
+    saved = &g_Inst.commandStack[--g_Inst.commandStackIndex];
+    // These only send anything if the color changed
+    FTGLCmdBGColor(saved->bgColor);
+    FTGLCmdFGColor(saved->fgColor);
+    FTGLCmdGradColor(saved->gradColor);
+    if (saved->matrixIdentity && !g_Inst.commandContext.matrixIdentity) {
+        FTGLCmdLoadIdentity();
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 void FTGLCmdInflate(uint32_t ptr, uint8_t *data, uint32_t count) { 
-    EnsureSpace(Aligned(sizeof(uint32_t) * 2 + count));
-    Append32(FT_CMD_INFLATE); Append32(ptr); AppendString(data, count); 
-    AlignBuffer();
+    uint32_t header[2] = { HOST_TO_FT_ULONG(FT_CMD_INFLATE), HOST_TO_FT_ULONG(ptr) };
+    AppendPayloadCommand(header, sizeof(header), data, count);
 }
 void FTGLCmdLoadImage(uint32_t ptr, uint32_t options, uint8_t *data, uint32_t count) {
-    EnsureSpace(Aligned(sizeof(uint32_t) * 3 + count));
-    Append32(FT_CMD_LOADIMAGE); Append32(ptr); Append32(options); AppendString(data, count);
-    AlignBuffer(); 
+    uint32_t header[3] = { HOST_TO_FT_ULONG(FT_CMD_LOADIMAGE), HOST_TO_FT_ULONG(ptr), HOST_TO_FT_ULONG(options) };
+    AppendPayloadCommand(header, sizeof(header), data, count);
+    // The image is set up in the current bitmap handle
+    InvalidateBitmapHandles();
 }
 
 void FTGLCmdButton(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t font, uint16_t options, const char *str, uint16_t len) {
-    EnsureSpace(Aligned(sizeof(uint32_t) + sizeof(uint16_t) * 6 + len));
-    Append32(FT_CMD_BUTTON);
-    Append16((uint16_t)x); Append16((uint16_t)y); Append16((uint16_t)w); Append16((uint16_t)h);
-    Append16(font); Append16(options); 
-    AppendString((const uint8_t*)str, len);
-    AlignBuffer();
+    if (CLIPPED(x, y, x + w, y + h)) { return; }
+#if FTGL_DEFERRED_DRAWS > 0
+    if (DEFERRING() && DeferDraw(DEFER_BUTTON, x, y, w, h, (int16_t)font, options, 0, str, len)) { return; }
+#endif
+    uint16_t header[8] = { HEADER_CMD(FT_CMD_BUTTON),
+                           HEADER16(x), HEADER16(y), HEADER16(w), HEADER16(h),
+                           HEADER16(font), HEADER16(options) };
+    AppendPayloadCommand(header, sizeof(header), (const uint8_t*)str, len);
+    InvalidatePrimitive();
 }
 
 void FTGLCmdClock(int16_t x, int16_t y, int16_t radius, uint16_t options, uint16_t h, uint16_t m, uint16_t s, uint16_t ms) {
+    if (CLIPPED(x - radius, y - radius, x + radius, y + radius)) { return; }
     EnsureSpace(sizeof(uint32_t) + sizeof(int16_t) * 8);
     Append32(FT_CMD_CLOCK);
     Append16((uint16_t)x); Append16((uint16_t)y); Append16((uint16_t)radius);
     Append16(options);
     Append16(h); Append16(m); Append16(s); Append16(ms);
+    InvalidatePrimitive();
 }
 
 void FTGLCmdFGColor(uint32_t color) {
+#if FTGL_DEFERRED_DRAWS > 0
+    if (DEFERRING()) {
+        g_Inst.deferredState.fgColor = color;
+        g_Inst.deferredDirty = 1;
+        return;
+    }
+#endif
 #if FTGL_CACHE_COMMAND_CONTEXT == 1
     if (g_Inst.commandContext.fgColor != color) {
         g_Inst.commandContext.fgColor = color;
@@ -740,6 +2847,13 @@ void FTGLCmdBGColor(uint32_t color) {
 }
 
 void FTGLCmdGradColor(uint32_t color) {
+#if FTGL_DEFERRED_DRAWS > 0
+    if (DEFERRING()) {
+        g_Inst.deferredState.gradColor = color;
+        g_Inst.deferredDirty = 1;
+        return;
+    }
+#endif
 #if FTGL_CACHE_COMMAND_CONTEXT == 1
     if (g_Inst.commandContext.gradColor != color) {
         g_Inst.commandContext.gradColor = color;
@@ -754,12 +2868,14 @@ void FTGLCmdGradColor(uint32_t color) {
 }
 
 void FTGLCmdGauge(int16_t x, int16_t y, int16_t r, uint16_t options, uint16_t major, uint16_t minor, uint16_t val, uint16_t range) {
+    if (CLIPPED(x - r, y - r, x + r, y + r)) { return; }
     EnsureSpace(sizeof(uint32_t) + sizeof(uint16_t) * 8);
     Append32(FT_CMD_GAUGE);
     Append16((uint16_t)x); Append16((uint16_t)y); Append16((uint16_t)r);
     Append16(options);
     Append16(major); Append16(minor);
     Append16(val); Append16(range);
+    InvalidatePrimitive();
 }
 
 void FTGLCmdGradient(int16_t x0, int16_t y0, uint32_t rgb0, int16_t x1, int16_t y1, uint32_t rgb1) {
@@ -769,18 +2885,20 @@ void FTGLCmdGradient(int16_t x0, int16_t y0, uint32_t rgb0, int16_t x1, int16_t
     Append32(rgb0);
     Append16((uint16_t)x1); Append16((uint16_t)y1);
     Append32(rgb1);
+    InvalidatePrimitive();
 }
 
 void FTGLCmdKeys(int16_t x, int16_t y, int16_t w, int16_t h, int16_t font, uint16_t options, const char* s, uint16_t len) {
-    EnsureSpace(Aligned(sizeof(uint32_t) + sizeof(uint16_t) * 6 + len));
-    Append32(FT_CMD_KEYS);
-    Append16((uint16_t)x); Append16((uint16_t)y); Append16((uint16_t)w); Append16((uint16_t)h);
-    Append16((uint16_t)font);
-    Append16(options); AppendString((const uint8_t*)s, len); 
-    AlignBuffer();
+    if (CLIPPED(x, y, x + w, y + h)) { return; }
+    uint16_t header[8] = { HEADER_CMD(FT_CMD_KEYS),
+                           HEADER16(x), HEADER16(y), HEADER16(w), HEADER16(h),
+                           HEADER16(font), HEADER16(options) };
+    AppendPayloadCommand(header, sizeof(header), (const uint8_t*)s, len);
+    InvalidatePrimitive();
 }
 
 void FTGLCmdProgress(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t options, uint16_t val, uint16_t range) {
+    if (CLIPPED(x, y, x + w, y + h)) { return; }
     EnsureSpace(sizeof(uint32_t) + sizeof(uint16_t) * 8);
     Append32(FT_CMD_PROGRESS);
     Append16((uint16_t)x); Append16((uint16_t)y); Append16((uint16_t)w); Append16((uint16_t)h);
@@ -788,50 +2906,64 @@ void FTGLCmdProgress(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t option
     Append16(val);
     Append16(range);
     Append16(0); // For alignment
+    InvalidatePrimitive();
 }
 
 void FTGLCmdScrollbar(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t options, uint16_t val, uint16_t size, uint16_t range) {
+    if (KNOB_CLIPPED(x, y, w, h, KNOB_SIZE(w, h))) { return; }
     EnsureSpace(sizeof(uint32_t) + sizeof(uint16_t) * 8);
     Append32(FT_CMD_SCROLLBAR);
     Append16((uint16_t)x); Append16((uint16_t)y); Append16((uint16_t)w); Append16((uint16_t)h);
     Append16(options); Append16(val); Append16(size); Append16(range);
+    InvalidatePrimitive();
 }
 
 void FTGLCmdSlider(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t options, uint16_t val, uint16_t range) {
+    if (KNOB_CLIPPED(x, y, w, h, KNOB_SIZE(w, h))) { return; }
     EnsureSpace(sizeof(uint32_t) + sizeof(uint16_t) * 8);
     Append32(FT_CMD_SLIDER);
     Append16((uint16_t)x); Append16((uint16_t)y); Append16((uint16_t)w); Append16((uint16_t)h);
     Append16(options); Append16(val); Append16(range);
     Append16(0); // For alignment
+    InvalidatePrimitive();
 }
 
 void FTGLCmdDial(int16_t x, int16_t y, int16_t r, uint16_t options, uint16_t val) {
+    if (CLIPPED(x - r, y - r, x + r, y + r)) { return; }
     EnsureSpace(sizeof(uint32_t) + sizeof(uint16_t) * 6);
     Append32(FT_CMD_DIAL);
     Append16((uint16_t)x); Append16((uint16_t)y); Append16((uint16_t)r);
     Append16(options); Append16(val); 
     Append16(0); // For alignment
+    InvalidatePrimitive();
 }
 
 void FTGLCmdToggle(int16_t x, int16_t y, int16_t w, int16_t font, uint16_t options, uint16_t state, const char* s, uint16_t len) {
-    EnsureSpace(Aligned(sizeof(uint32_t) + sizeof(uint16_t) * 6 + len));
-    Append32(FT_CMD_TOGGLE);
-    Append16((uint16_t)x); Append16((uint16_t)y); Append16((uint16_t)w); 
-    Append16((uint16_t)font);
-    Append16(options); AppendString((const uint8_t*)s, len); 
-    AlignBuffer();
+    if (ToggleClipped(x, y, w, font)) { return; }
+    uint16_t header[8] = { HEADER_CMD(FT_CMD_TOGGLE),
+                           HEADER16(x), HEADER16(y), HEADER16(w),
+                           HEADER16(font), HEADER16(options), HEADER16(state) };
+    AppendPayloadCommand(header, sizeof(header), (const uint8_t*)s, len);
+    InvalidatePrimitive();
 }
 
 void FTGLCmdText(int16_t x, int16_t y, int16_t font, uint16_t options, const char* s, uint16_t len) {
-    EnsureSpace(Aligned(sizeof(uint32_t) + sizeof(uint16_t) * 4 + len));
-    Append32(FT_CMD_TEXT);
-    Append16((uint16_t)x); Append16((uint16_t)y);
-    Append16((uint16_t)font);
-    Append16(options); AppendString((const uint8_t*)s, len);
-    AlignBuffer();
+    if (TextClipped(x, y, font, options)) { return; }
+#if FTGL_DEFERRED_DRAWS > 0
+    if (DEFERRING() && DeferDraw(DEFER_TEXT, x, y, 0, 0, font, options, 0, s, len)) { return; }
+#endif
+    uint16_t header[6] = { HEADER_CMD(FT_CMD_TEXT),
+                           HEADER16(x), HEADER16(y),
+                           HEADER16(font), HEADER16(options) };
+    AppendPayloadCommand(header, sizeof(header), (const uint8_t*)s, len);
+    InvalidatePrimitive();
 }
 
 void FTGLCmdNumber(int16_t x, int16_t y, int16_t font, uint16_t options, int32_t n) {
+    if (TextClipped(x, y, font, options)) { return; }
+#if FTGL_DEFERRED_DRAWS > 0
+    if (DEFERRING() && DeferDraw(DEFER_NUMBER, x, y, 0, 0, font, options, n, NULL, 0)) { return; }
+#endif
     EnsureSpace(sizeof(uint32_t) * 2 + sizeof(uint16_t) * 4);
     Append32(FT_CMD_NUMBER);
     Append16((uint16_t)x); Append16((uint16_t)y);
@@ -839,10 +2971,14 @@ void FTGLCmdNumber(int16_t x, int16_t y, int16_t font, uint16_t options, int32_t
     Append16(options); 
     Append32((uint32_t)n);
 
+    InvalidatePrimitive();
 }
 
 void FTGLCmdLoadIdentity(void) {
     DLCommand(FT_CMD_LOADIDENTITY);
+#if FTGL_CACHE_COMMAND_CONTEXT == 1
+    g_Inst.commandContext.matrixIdentity = 1;
+#endif
 }
 
 void FTGLCmdTranslate(int32_t tx, int32_t ty) {
@@ -850,6 +2986,9 @@ void FTGLCmdTranslate(int32_t tx, int32_t ty) {
     Append32(FT_CMD_TRANSLATE);
     Append32((uint32_t)tx);
     Append32((uint32_t)ty);
+#if FTGL_CACHE_COMMAND_CONTEXT == 1
+    g_Inst.commandContext.matrixIdentity = 0;
+#endif
 }
 
 void FTGLCmdScale(int32_t sx, int32_t sy) {
@@ -857,16 +2996,27 @@ void FTGLCmdScale(int32_t sx, int32_t sy) {
     Append32(FT_CMD_SCALE);
     Append32((uint32_t)sx);
     Append32((uint32_t)sy);
+#if FTGL_CACHE_COMMAND_CONTEXT == 1
+    g_Inst.commandContext.matrixIdentity = 0;
+#endif
 }
 
 void FTGLCmdRotate(int32_t a) {
     EnsureSpace(sizeof(uint32_t) * 2);
     Append32(FT_CMD_ROTATE);
     Append32((uint32_t)a);
+#if FTGL_CACHE_COMMAND_CONTEXT == 1
+    g_Inst.commandContext.matrixIdentity = 0;
+#endif
 }
 
 void FTGLCmdSetMatrix(void) {
     DLCommand(FT_CMD_SETMATRIX);
+#if FTGL_CACHE_GRAPHICS_CONTEXT == 1 && FTGL_CACHE_COMMAND_CONTEXT == 1
+    SetTransformIdentity(g_Inst.commandContext.matrixIdentity);
+#elif FTGL_CACHE_GRAPHICS_CONTEXT == 1
+    SetTransformIdentity(0);
+#endif
 }
 
 // CmdCalibrate not available as a command, instead, call FTGLRunCalibration(&output) to run a calibration routine
@@ -884,6 +3034,9 @@ void FTGLCmdSpinner(int16_t x, int16_t y, uint16_t style, uint16_t scale) {
     Append16((uint16_t)y);
     Append16(style);
     Append16(scale);
+    InvalidatePrimitive();
+    // Continuous commands swap display lists on their own
+    FTGLInvalidateFrame();
 }
 
 void FTGLCmdScreensaver(void) {
@@ -894,6 +3047,8 @@ void FTGLCmdScreensaver(void) {
     g_Inst.commandContext.continuousCommandActive = 1;
 #endif
     DLCommand(FT_CMD_SCREENSAVER);
+    InvalidatePrimitive();
+    FTGLInvalidateFrame();
 }
 
 void FTGLCmdSketch(int16_t x, int16_t y, uint16_t w, uint16_t h, uint32_t ptr, uint16_t format) {
@@ -912,6 +3067,14 @@ void FTGLCmdSketch(int16_t x, int16_t y, uint16_t w, uint16_t h, uint32_t ptr, u
     Append32(ptr);
     Append16(format);
     Append16(0); // For alignment
+    // Sketching draws into RAM_G
+    FTGLInvalidateFrame();
+}
+
+void FTGLCmdInterrupt(uint32_t ms) {
+    EnsureSpace(sizeof(uint32_t) * 2);
+    Append32(FT_CMD_INTERRUPT);
+    Append32(ms);
 }
 
 void FTGLCmdStop(void) {
@@ -940,13 +3103,18 @@ void FTGLCmdSnapshot(uint32_t ptr) {
     EnsureSpace(sizeof(uint32_t) * 2);
     Append32(FT_CMD_SNAPSHOT);
     Append32(ptr);
+    FTGLInvalidateFrame();
 }
 
 void FTGLCmdLogo(void) {
     DLCommand(FT_CMD_LOGO);
+    InvalidatePrimitive();
+    // The logo animation puts its own display lists on the screen
+    FTGLInvalidateFrame();
 }
 
-static void ComputeSizeAndStride(uint8_t format, uint32_t widthInPixels, uint32_t totalHeight, uint32_t *size, uint32_t *stride) {
+// Bytes per pixel of a bitmap format, as multiplier / divider
+static void FormatRatio(uint8_t format, uint32_t *multiplierOut, uint32_t *dividerOut) {
     uint32_t multiplier = 1, divider = 1;
     switch (format) {
     case FT_L1: multiplier = 1; divider = 8; break;
@@ -965,6 +3133,13 @@ static void ComputeSizeAndStride(uint8_t format, uint32_t widthInPixels, uint32_
         multiplier = 1; divider = 1;
         break;
     }
+    *multiplierOut = multiplier;
+    *dividerOut = divider;
+}
+
+static void ComputeSizeAndStride(uint8_t format, uint32_t widthInPixels, uint32_t totalHeight, uint32_t *size, uint32_t *stride) {
+    uint32_t multiplier, divider;
+    FormatRatio(format, &multiplier, &divider);
 
     uint32_t multiplied = (multiplier * widthInPixels);
     uint32_t linestride = multiplied / divider;
@@ -974,65 +3149,79 @@ static void ComputeSizeAndStride(uint8_t format, uint32_t widthInPixels, uint32_
     *stride = linestride;
 }
 
+// Finds a free bitmap id and allocates size bytes of RAM_G for it. Returns
+// -1 if either one is not available.
+static int AllocateBitmap(uint32_t size) {
+    int id;
+    uint32_t addr;
+
+    for (id = 0; id < FTGL_MAX_BITMAPS; id++) {
+        if (!g_Inst.bitmaps[id].allocated) { break; }
+    }
+    if (id == FTGL_MAX_BITMAPS) { return -1; }
+
+    addr = AllocateRam(size, RAM_OWNER_BITMAP, (int16_t)id);
+    if (addr == FTGL_RAM_NONE) { return -1; }
+
+    g_Inst.bitmaps[id].allocated = 1;
+    g_Inst.bitmaps[id].layerValid = 0;
+    g_Inst.bitmaps[id].bitmapAddress = addr;
+    g_Inst.bitmaps[id].bitmapDataSize = size;
+    g_Inst.bitmaps[id].activeHandle = -1;
+    return id;
+}
+
 int FTGLCreateBitmap(uint8_t format, int widthInPixels, int heightInLines) {
     uint32_t stride, imgsize;
     ComputeSizeAndStride(format, widthInPixels, heightInLines, &imgsize, &stride);
-    uint32_t addr = g_Inst.graphicsRamIndex;
 
-    g_Inst.graphicsRamIndex += imgsize;
-    int id = g_Inst.bitmapIndex++;
+    int id = AllocateBitmap(imgsize);
+    if (id < 0) { return -1; }
 
-    g_Inst.bitmaps[id].bitmapAddress = addr;
-    g_Inst.bitmaps[id].bitmapDataSize = imgsize;
     g_Inst.bitmaps[id].bitmapLayout = FT_BITMAP_LAYOUT(format, stride, heightInLines);
     g_Inst.bitmaps[id].bitmapSize = FT_BITMAP_SIZE(FT_BILINEAR, FT_BORDER, FT_BORDER, widthInPixels, heightInLines);
-    g_Inst.bitmaps[id].activeHandle = -1;
 
     return id;
 }
 
+void FTGLDestroyBitmap(int id) {
+    if (id < 0 || id >= FTGL_MAX_BITMAPS || !g_Inst.bitmaps[id].allocated) { return; }
+#if FTGL_CACHE_BITMAP_HANDLES == 1
+    FTGLUnpinBitmap(id);
+#endif
+    UnloadBitmap(id);
+    FreeRam(g_Inst.bitmaps[id].bitmapAddress);
+    g_Inst.bitmaps[id].allocated = 0;
+}
+
 void FTGLSetBitmapParams(int id, uint8_t filter, uint8_t wrapx, uint8_t wrapy) {
     uint32_t bms = FT_BITMAP_SIZE(filter, wrapx, wrapy, 0, 0);
     g_Inst.bitmaps[id].bitmapSize = bms | (g_Inst.bitmaps[id].bitmapSize & 0x1FFFF);
-
-#if FTGL_CACHE_BITMAP_HANDLES == 1
-    if (g_Inst.bitmaps[id].activeHandle >= 0) {
-        g_Inst.bitmapHandles[g_Inst.bitmaps[id].activeHandle] = -1;
-        g_Inst.bitmaps[id].activeHandle = -1;
-    }
-#endif
+    UnloadBitmap(id);
 }
 
 void FTGLSetBitmapSize(int id, uint16_t renderWidth, uint16_t renderHeight) {
     uint32_t size = FT_BITMAP_SIZE(0, 0, 0, renderWidth, renderHeight);
     g_Inst.bitmaps[id].bitmapSize = size | (g_Inst.bitmaps[id].bitmapSize & ~0x1FFFF);
-#if FTGL_CACHE_BITMAP_HANDLES == 1
-    if (g_Inst.bitmaps[id].activeHandle >= 0) {
-        g_Inst.bitmapHandles[g_Inst.bitmaps[id].activeHandle] = -1;
-        g_Inst.bitmaps[id].activeHandle = -1;
-    }
-#endif
+    UnloadBitmap(id);
 }
 
 int FTGLCreateBitmapVerbose(uint8_t format, uint16_t stride, uint16_t layoutHeight, uint16_t numCells,
     uint8_t filter, uint8_t wrapx, uint8_t wrapy, uint16_t renderWidth, uint16_t renderHeight) {
-    uint32_t size = stride * layoutHeight * numCells;
-    uint32_t addr = g_Inst.graphicsRamIndex;
+    uint32_t size = (uint32_t)stride * layoutHeight * numCells;
 
-    g_Inst.graphicsRamIndex += size;
-    int id = g_Inst.bitmapIndex++;
+    int id = AllocateBitmap(size);
+    if (id < 0) { return -1; }
 
-    g_Inst.bitmaps[id].bitmapAddress = addr;
-    g_Inst.bitmaps[id].bitmapDataSize = size;
     g_Inst.bitmaps[id].bitmapLayout = FT_BITMAP_LAYOUT(format, stride, layoutHeight);
     g_Inst.bitmaps[id].bitmapSize = FT_BITMAP_SIZE(filter, wrapx, wrapy, renderWidth, renderHeight);
-    g_Inst.bitmaps[id].activeHandle = -1;
 
     return id;
 }
 
 // Load bitmap data into RAM_G memory
 void FTGLBitmapBufferData(int id, uint32_t offset, const uint8_t *data, uint32_t count) {
+    FTGLInvalidateFrame();
     FTHWWrite(g_Inst.bitmaps[id].bitmapAddress + offset, data, count);
 }
 
@@ -1043,13 +3232,18 @@ void FTGLCmdBitmap(int id, int x, int y) {
 }
 
 void FTGLCmdBitmapCell(int id, int x, int y, int cell) {
-#if FTGL_CACHE_BITMAP_HANDLES == 1
-    int8_t handle = g_Inst.bitmaps[id].activeHandle;
-    if (handle < 0) { // Need to load the bitmap into a handle
-        handle = FTGLUseBitmap(id); // Pick a handle and load into it
+#if FTGL_CLIP_STACK_DEPTH > 0
+    if (g_Inst.clipIndex > 0) {
+        uint32_t size = g_Inst.bitmaps[id].bitmapSize;
+        int32_t w = (size >> 9) & 511, h = size & 511;
+        if (Clipped(x, y, x + (w ? w : 512), y + (h ? h : 512))) { return; }
     }
-
-    FTGLDrawBitmapInHandle(handle, x, y, cell);
+#endif
+#if FTGL_DEFERRED_DRAWS > 0
+    if (DEFERRING() && DeferDraw(DEFER_BITMAP, (int16_t)x, (int16_t)y, 0, 0, (int16_t)id, (uint16_t)cell, 0, NULL, 0)) { return; }
+#endif
+#if FTGL_CACHE_BITMAP_HANDLES == 1
+    FTGLDrawBitmapInHandle(FTGLUseBitmap(id), x, y, cell);
 #else 
     FTGLSetBitmapHandle(0, id);
     FTGLDrawBitmapInHandle(0, x, y, cell);
@@ -1057,50 +3251,93 @@ void FTGLCmdBitmapCell(int id, int x, int y, int cell) {
 }
 
 #if FTGL_CACHE_BITMAP_HANDLES == 1
+// Picks the handle to load a bitmap into: an empty one if there is one,
+// otherwise the least recently used handle that is not pinned. Handles drawn
+// from an earlier frame's load are only taken if nothing else is left.
 static int8_t PickHandleToEvict(void) {
-    int i, selected = -1;
+    int8_t i, selected = -1, carried = -1;
     for (i = 0; i < FTGL_NUM_BITMAP_HANDLES; i++) {
-        
-        if (g_Inst.nextHandle == g_Inst.lastHandle) { 
-            g_Inst.nextHandle++;
-            continue; 
-        } // Skip last used handle
-        selected = g_Inst.nextHandle; // Select this handle to use
-        if (g_Inst.bitmapHandles[g_Inst.nextHandle] == -1) { 
-            g_Inst.nextHandle++;
-            break; 
-        } // Favor empty handles
-
-        g_Inst.nextHandle += 1;
-        if (g_Inst.nextHandle >= FTGL_NUM_BITMAP_HANDLES) {
-            g_Inst.nextHandle = 0;
+        int16_t id = g_Inst.bitmapHandles[i];
+        if (id < 0) { return i; } // Favor empty handles
+        if (g_Inst.bitmaps[id].pinned) { continue; }
+
+        if (g_Inst.handlesCarried & (1 << i)) {
+            if (carried < 0 || g_Inst.handleLastUse[i] < g_Inst.handleLastUse[carried]) {
+                carried = i;
+            }
+        } else if (selected < 0 || g_Inst.handleLastUse[i] < g_Inst.handleLastUse[selected]) {
+            selected = i;
         }
     }
-    return selected;
+    return selected >= 0 ? selected : carried;
 }
 
 int8_t FTGLUseBitmap(int bitmapId) {
-    int selected = PickHandleToEvict();
-    return FTGLSetBitmapHandle(selected, bitmapId);
+    int8_t handle;
+    // Held bitmap draws may need a handle too, so they pick theirs first
+    DEFER_BARRIER();
+    handle = g_Inst.bitmaps[bitmapId].activeHandle;
+    if (handle >= 0) {
+        g_Inst.handleStats.hits++;
+        if (!(g_Inst.handlesLoaded & (1 << handle))) {
+            g_Inst.handlesCarried |= 1 << handle;
+        }
+        g_Inst.handleLastUse[handle] = ++g_Inst.handleUseCount;
+        return handle;
+    }
+
+    handle = PickHandleToEvict();
+    g_Inst.handleStats.misses++;
+    if (g_Inst.bitmapHandles[handle] >= 0) {
+        g_Inst.handleStats.evictions++;
+    }
+    return FTGLSetBitmapHandle(handle, bitmapId);
 }   
 
 int8_t FTGLGetEmptyHandle(void) {
-    int selected = PickHandleToEvict();
-    uint8_t oldBitmapId = g_Inst.bitmapHandles[selected];
+    int8_t selected;
+    DEFER_BARRIER();
+    selected = PickHandleToEvict();
+    int16_t oldBitmapId = g_Inst.bitmapHandles[selected];
     if (oldBitmapId >= 0) {
         g_Inst.bitmaps[oldBitmapId].activeHandle = -1;
     }
     g_Inst.bitmapHandles[selected] = -1;
+    g_Inst.handleLastUse[selected] = ++g_Inst.handleUseCount;
     return selected;
 }
+
+int FTGLPinBitmap(int bitmapId) {
+    if (!g_Inst.bitmaps[bitmapId].pinned) {
+        // Leave at least one handle for everything else
+        if (g_Inst.pinnedCount >= FTGL_NUM_BITMAP_HANDLES - 1) { return -1; }
+        g_Inst.bitmaps[bitmapId].pinned = 1;
+        g_Inst.pinnedCount++;
+    }
+    return 0;
+}
+
+void FTGLUnpinBitmap(int bitmapId) {
+    if (g_Inst.bitmaps[bitmapId].pinned) {
+        g_Inst.bitmaps[bitmapId].pinned = 0;
+        g_Inst.pinnedCount--;
+    }
+}
+
+void FTGLGetBitmapHandleStats(FTGLBitmapHandleStats *stats) {
+    *stats = g_Inst.handleStats;
+}
 #endif
 
 int8_t FTGLSetBitmapHandle(int8_t handle, int bitmapId) {
 #if FTGL_CACHE_BITMAP_HANDLES == 1
-    int8_t oldBitmapId = g_Inst.bitmapHandles[handle];
+    int16_t oldBitmapId = g_Inst.bitmapHandles[handle];
     if (oldBitmapId >= 0) {
         g_Inst.bitmaps[oldBitmapId].activeHandle = -1;
     }
+    g_Inst.bitmapHandles[handle] = (int16_t)bitmapId;
+    g_Inst.handlesLoaded |= 1 << handle;
+    g_Inst.handleLastUse[handle] = ++g_Inst.handleUseCount;
 #endif
 
     FTGLBitmapHandle(handle);
@@ -1117,7 +3354,6 @@ void FTGLDrawBitmapInHandle(int8_t handle, int x, int y, int cell) {
     FTGLBegin(FT_BITMAPS);
         FTGLVertex2ii(x, y, handle, cell);
     FTGLEnd();
-    g_Inst.lastHandle = (int8_t)handle;
 }
 
 void FTGLGetBitmapSize(int id, int *width, int *height) {
@@ -1126,11 +3362,413 @@ void FTGLGetBitmapSize(int id, int *width, int *height) {
 }
 
 
+//// Layers
+int FTGLCreateLayer(uint16_t width, uint16_t height) {
+    if (width == 0 || height == 0 || width > 511 || height > 511) { return -1; }
+    // CMD_SNAPSHOT always writes ARGB4
+    return FTGLCreateBitmap(FT_ARGB4, width, height);
+}
+
+int FTGLLayerValid(int layerId) {
+    return g_Inst.bitmaps[layerId].layerValid;
+}
+
+void FTGLInvalidateLayer(int layerId) {
+    g_Inst.bitmaps[layerId].layerValid = 0;
+}
+
+int FTGLBeginLayer(int layerId) {
+    if (g_Inst.inFrame || g_Inst.renderingLayer >= 0) { return -1; }
+    g_Inst.renderingLayer = (int16_t)layerId;
+    FTGLBeginBuffer();
+    return 0;
+}
+
+int FTGLEndLayer(void) {
+    BitmapInfo *layer;
+
+    if (g_Inst.renderingLayer < 0) { return -1; }
+    layer = &g_Inst.bitmaps[g_Inst.renderingLayer];
+    g_Inst.renderingLayer = -1;
+
+    // The layer has to be on the screen to be snapshotted, and it is not
+    // the frame that was there before, so it can not be dropped.
+    FTGLInvalidateFrame();
+    FTGLSwapBuffers();
+#if FTGL_ASYNC_TRANSFER == 1
+    g_Inst.framePending = 0;
+#endif
+    WaitForQueueEmpty();
+    if (WaitForSwap() < 0) {
+        // The layer never reached the screen, so there is nothing to capture
+        return -1;
+    }
+
+    // The snapshot is the size of the screen registers, and the display is
+    // turned off while they do not match the panel.
+    WriteReg8(FT_REG_PCLK, FT_ZERO);
+    WriteReg16(FT_REG_HSIZE, (uint16_t)((layer->bitmapSize >> 9) & 511));
+    WriteReg16(FT_REG_VSIZE, (uint16_t)(layer->bitmapSize & 511));
+    BeginAppend();
+    EnsureSpace(sizeof(uint32_t) * 2);
+    Append32(FT_CMD_SNAPSHOT);
+    Append32(layer->bitmapAddress);
+    EndAppend();
+    PublishCommands();
+    WaitForQueueEmpty();
+    WriteReg16(FT_REG_HSIZE, FT_DISPLAY_HSIZE);
+    WriteReg16(FT_REG_VSIZE, FT_DISPLAY_VSIZE);
+    WriteReg8(FT_REG_PCLK, FT_DISPLAY_PCLK);
+
+    // The screen now shows the layer, not the last frame
+    FTGLInvalidateFrame();
+    layer->layerValid = 1;
+    return 0;
+}
+
+// Copies count bytes from src down to dest. CMD_MEMCPY does not promise
+// anything about overlapping copies, so when the two overlap the copy is done
+// in pieces no larger than the distance between them.
+static void MoveRam(uint32_t dest, uint32_t src, uint32_t count) {
+    uint32_t step = src - dest, offset;
+    if (step > count) { step = count; }
+    for (offset = 0; offset < count; offset += step) {
+        EnsureSpace(sizeof(uint32_t) * 4);
+        Append32(FT_CMD_MEMCPY);
+        Append32(dest + offset);
+        Append32(src + offset);
+        Append32(count - offset < step ? count - offset : step);
+    }
+}
+
+// The frame on screen reads its bitmaps straight out of RAM_G, so before
+// any of them move it is replaced with a blank one. The last frame's swap
+// has to finish first, or the blank display list would overwrite it before
+// it is shown.
+static int BlankScreenForMove(void) {
+#if FTGL_ASYNC_TRANSFER == 1
+    if (g_Inst.framePending) {
+        WaitForQueueEmpty();
+        ReadTouch();
+        g_Inst.framePending = 0;
+    }
+#endif
+    WritePendingMacros();
+    WaitForQueueEmpty();
+    if (WaitForSwap() < 0) { return -1; }
+    WriteBlankScreen();
+    if (WaitForSwap() < 0) { return -1; }
+    // The next frame has to be sent even if it matches the one blanked out
+    FTGLInvalidateFrame();
+    return 0;
+}
+
+int FTGLCompactMemory(void) {
+    uint32_t next = FT_RAM_G;
+    uint8_t i, movedBitmap = 0;
+
+    // A frame being built may already use the current addresses
+    if (g_Inst.inFrame || g_Inst.renderingLayer >= 0) { return -1; }
+
+    for (i = 0; i < g_Inst.ramBlockCount; i++) {
+        RamBlock *block = &g_Inst.ramBlocks[i];
+        if (block->address != next && block->ownerType == RAM_OWNER_BITMAP) {
+            if (BlankScreenForMove() < 0) { return -1; }
+            break;
+        }
+        next += block->size;
+    }
+
+    next = FT_RAM_G;
+    BeginAppend();
+    for (i = 0; i < g_Inst.ramBlockCount; i++) {
+        RamBlock *block = &g_Inst.ramBlocks[i];
+        if (block->address != next) {
+            MoveRam(next, block->address, block->size);
+            block->address = next;
+            if (block->ownerType == RAM_OWNER_BITMAP) {
+                g_Inst.bitmaps[block->ownerId].bitmapAddress = next;
+                UnloadBitmap(block->ownerId);
+                movedBitmap = 1;
+            } else {
+                g_Inst.segments[block->ownerId].address = next;
+            }
+        }
+        next += block->size;
+    }
+    EndAppend();
+    PublishCommands();
+    WaitForQueueEmpty();
+
+    if (movedBitmap) {
+        // Recordings hold the addresses of the bitmaps they draw
+        int16_t s;
+        for (s = 0; s < g_Inst.segmentCount; s++) {
+            g_Inst.segments[s].size = 0;
+        }
+    }
+    return 0;
+}
+
+void FTGLGetMemoryInfo(FTGLMemoryInfo *info) {
+    uint32_t prevEnd = FT_RAM_G;
+    uint8_t i;
+
+    info->usedBytes = 0;
+    info->largestFreeBlock = 0;
+    info->blockCount = g_Inst.ramBlockCount;
+    for (i = 0; i <= g_Inst.ramBlockCount; i++) {
+        uint32_t end = i < g_Inst.ramBlockCount ? g_Inst.ramBlocks[i].address : FT_RAM_G + FT_RAM_G_SIZE;
+        if (end - prevEnd > info->largestFreeBlock) {
+            info->largestFreeBlock = end - prevEnd;
+        }
+        if (i < g_Inst.ramBlockCount) {
+            info->usedBytes += g_Inst.ramBlocks[i].size;
+            prevEnd = g_Inst.ramBlocks[i].address + g_Inst.ramBlocks[i].size;
+        }
+    }
+    info->freeBytes = FT_RAM_G_SIZE - info->usedBytes;
+    info->fragmentation = info->freeBytes == 0 ? 0 :
+        (uint8_t)(100 - (uint64_t)info->largestFreeBlock * 100 / info->freeBytes);
+}
+
+// Memory commands change RAM_G behind the frame elision check. Outside of
+// a frame they are sent on their own and waited for, like the calibration.
+static void BeginMemoryCommand(void) {
+    FTGLInvalidateFrame();
+    if (!g_Inst.inFrame) { BeginAppend(); }
+}
+
+static void EndMemoryCommand(void) {
+    if (!g_Inst.inFrame) {
+        EndAppend();
+        PublishCommands();
+        WaitForQueueEmpty();
+    }
+}
+
+static void AppendMemSet(uint32_t ptr, uint8_t value, uint32_t num) {
+    EnsureSpace(sizeof(uint32_t) * 4);
+    Append32(FT_CMD_MEMSET);
+    Append32(ptr);
+    Append32(value);
+    Append32(num);
+}
+
+void FTGLCmdMemSet(uint32_t ptr, uint8_t value, uint32_t num) {
+    BeginMemoryCommand();
+    AppendMemSet(ptr, value, num);
+    EndMemoryCommand();
+}
+
+void FTGLCmdMemZero(uint32_t ptr, uint32_t num) {
+    BeginMemoryCommand();
+    EnsureSpace(sizeof(uint32_t) * 3);
+    Append32(FT_CMD_MEMZERO);
+    Append32(ptr);
+    Append32(num);
+    EndMemoryCommand();
+}
+
+void FTGLCmdMemCpy(uint32_t dest, uint32_t src, uint32_t num) {
+    BeginMemoryCommand();
+    EnsureSpace(sizeof(uint32_t) * 4);
+    Append32(FT_CMD_MEMCPY);
+    Append32(dest);
+    Append32(src);
+    Append32(num);
+    EndMemoryCommand();
+}
+
+void FTGLCmdMemWrite(uint32_t ptr, const uint8_t *data, uint32_t num) {
+    uint32_t header[3] = { HOST_TO_FT_ULONG(FT_CMD_MEMWRITE), HOST_TO_FT_ULONG(ptr), HOST_TO_FT_ULONG(num) };
+    BeginMemoryCommand();
+    AppendPayloadCommand(header, sizeof(header), data, num);
+    EndMemoryCommand();
+}
+
+// Appends the result words of a command, which the coprocessor replaces
+// with its results. Returns where they are in RAM_CMD.
+static uint16_t AppendResults(uint8_t count) {
+    uint16_t index = g_Inst.cmdQueueWriteIndex;
+    while (count--) { Append32(0); }
+    return index;
+}
+
+// Waits for the coprocessor to run everything written so far, so that the
+// results it wrote into the command queue can be read.
+static void WaitForResults(void) {
+    DEFER_BARRIER();
+    EndAppend();
+    PublishCommands();
+    WaitForQueueEmpty();
+    if (g_Inst.inFrame) { BeginAppend(); }
+}
+
+static uint32_t ReadResult(uint16_t index, uint8_t n) {
+    return ReadReg32(FT_RAM_CMD + ((index + n * sizeof(uint32_t)) & FTGL_QUEUE_MASK));
+}
+
+// Sends everything the reader gives, up to count bytes, padded to a 4 byte
+// boundary. The buffer is filled completely before it is sent, so the queue
+// is only ever published at a 4 byte boundary. Returns the bytes sent,
+// without the padding.
+static uint32_t AppendStream(FTGLReader reader, void *context, uint32_t count) {
+    uint8_t buffer[FTGL_STREAM_CHUNK_SIZE];
+    uint32_t total = 0;
+    uint16_t n = 0, got = 1;
+
+    while (got > 0 && total < count) {
+        uint32_t want = count - total;
+        uint16_t room = (uint16_t)(FTGL_STREAM_CHUNK_SIZE - n);
+        if (want > room) { want = room; }
+        got = reader(context, &buffer[n], (uint16_t)want);
+        n += got;
+        total += got;
+        if (n == FTGL_STREAM_CHUNK_SIZE || got == 0 || total == count) {
+            while (n & 0x3) { buffer[n++] = 0; }
+            if (n > 0) {
+                EnsureSpace(n);
+                AppendBytes(buffer, n);
+            }
+            n = 0;
+        }
+    }
+    return total;
+}
+
+uint32_t FTGLCmdMemCrc(uint32_t ptr, uint32_t num) {
+    uint16_t index;
+    if (!g_Inst.inFrame) { BeginAppend(); }
+    EnsureSpace(sizeof(uint32_t) * 4);
+    Append32(FT_CMD_MEMCRC);
+    Append32(ptr);
+    Append32(num);
+    index = AppendResults(1);
+    WaitForResults();
+    return ReadResult(index, 0);
+}
+
+static uint32_t GetPtr(void) {
+    uint16_t index;
+    EnsureSpace(sizeof(uint32_t) * 2);
+    Append32(FT_CMD_GETPTR);
+    index = AppendResults(1);
+    WaitForResults();
+    return ReadResult(index, 0);
+}
+
+static uint32_t GetProps(uint32_t *width, uint32_t *height) {
+    uint16_t index;
+    EnsureSpace(sizeof(uint32_t) * 4);
+    Append32(FT_CMD_GETPROPS);
+    index = AppendResults(3);
+    WaitForResults();
+    if (width) { *width = ReadResult(index, 1); }
+    if (height) { *height = ReadResult(index, 2); }
+    return ReadResult(index, 0);
+}
+
+uint32_t FTGLCmdGetPtr(void) {
+    if (!g_Inst.inFrame) { BeginAppend(); }
+    return GetPtr();
+}
+
+uint32_t FTGLCmdGetProps(uint32_t *width, uint32_t *height) {
+    if (!g_Inst.inFrame) { BeginAppend(); }
+    return GetProps(width, height);
+}
+
+uint32_t FTGLCmdInflateStream(uint32_t ptr, FTGLReader reader, void *context) {
+    BeginMemoryCommand();
+    EnsureSpace(sizeof(uint32_t) * 2);
+    Append32(FT_CMD_INFLATE);
+    Append32(ptr);
+    AppendStream(reader, context, 0xFFFFFFFF);
+    return GetPtr();
+}
+
+uint32_t FTGLCmdLoadImageStream(uint32_t ptr, uint32_t options, FTGLReader reader, void *context,
+    uint32_t *width, uint32_t *height) {
+    BeginMemoryCommand();
+    EnsureSpace(sizeof(uint32_t) * 3);
+    Append32(FT_CMD_LOADIMAGE);
+    Append32(ptr);
+    Append32(options);
+    AppendStream(reader, context, 0xFFFFFFFF);
+    // The image is set up in the current bitmap handle
+    InvalidateBitmapHandles();
+    return GetProps(width, height);
+}
+
+uint32_t FTGLCmdMemWriteStream(uint32_t ptr, uint32_t num, FTGLReader reader, void *context) {
+    static const uint8_t zeros[4] = { 0, 0, 0, 0 };
+    uint32_t total, missing;
+
+    BeginMemoryCommand();
+    EnsureSpace(sizeof(uint32_t) * 3);
+    Append32(FT_CMD_MEMWRITE);
+    Append32(ptr);
+    Append32(num);
+    total = AppendStream(reader, context, num);
+
+    // The coprocessor waits for all num bytes, so a reader that ends early
+    // is made up for with zeros
+    missing = ((num + 3) & ~(uint32_t)3) - ((total + 3) & ~(uint32_t)3);
+    while (missing > 0) {
+        EnsureSpace(sizeof(zeros));
+        AppendBytes(zeros, sizeof(zeros));
+        missing -= sizeof(zeros);
+    }
+    EndMemoryCommand();
+    return total;
+}
+
+void FTGLClearBitmap(int id) {
+    FTGLCmdMemZero(g_Inst.bitmaps[id].bitmapAddress, g_Inst.bitmaps[id].bitmapDataSize);
+}
+
+void FTGLCopyBitmap(int destId, int srcId) {
+    uint32_t size = g_Inst.bitmaps[destId].bitmapDataSize;
+    if (g_Inst.bitmaps[srcId].bitmapDataSize < size) { size = g_Inst.bitmaps[srcId].bitmapDataSize; }
+    FTGLCmdMemCpy(g_Inst.bitmaps[destId].bitmapAddress, g_Inst.bitmaps[srcId].bitmapAddress, size);
+}
+
+void FTGLFillBitmapRect(int id, int x, int y, int w, int h, uint8_t value) {
+    uint32_t layout = g_Inst.bitmaps[id].bitmapLayout;
+    uint32_t stride = (layout >> 9) & 1023, rows, multiplier, divider, start, end;
+    int row;
+
+    if (stride == 0 || w <= 0 || h <= 0 || x < 0 || y < 0) { return; }
+    FormatRatio((uint8_t)((layout >> 19) & 31), &multiplier, &divider);
+
+    // Sub-byte pixels are filled a whole byte at a time
+    start = (uint32_t)x * multiplier / divider;
+    end = ((uint32_t)(x + w) * multiplier + divider - 1) / divider;
+    if (end > stride) { end = stride; }
+    rows = g_Inst.bitmaps[id].bitmapDataSize / stride;
+    if (start >= end || (uint32_t)y >= rows) { return; }
+    if ((uint32_t)(y + h) > rows) { h = (int)(rows - (uint32_t)y); }
+
+    BeginMemoryCommand();
+    if (start == 0 && end == stride) {
+        // Whole rows are contiguous
+        AppendMemSet(g_Inst.bitmaps[id].bitmapAddress + (uint32_t)y * stride, value, (uint32_t)h * stride);
+    } else {
+        for (row = y; row < y + h; row++) {
+            AppendMemSet(g_Inst.bitmaps[id].bitmapAddress + (uint32_t)row * stride + start, value, end - start);
+        }
+    }
+    EndMemoryCommand();
+}
+
 void FTGLLoadPalleteData(uint8_t offset, uint32_t *colors, uint8_t count) {
+    FTGLInvalidateFrame();
     FTHWWrite(FT_RAM_PAL + offset * sizeof(uint32_t), (const uint8_t*)colors, count * sizeof(uint32_t));
 }
 
 void FTGLSetPalleteColor(uint8_t value, uint32_t color) {
+    FTGLInvalidateFrame();
     WriteReg32(FT_RAM_PAL + value, HOST_TO_FT_ULONG(color));
 }
 
@@ -1143,9 +3781,17 @@ void FTGLRunCalibration(void) {
     EnsureSpace(sizeof(uint32_t) * 2);
     Append32(FT_CMD_CALIBRATE);
     Append32(0);
-    FTHWEndAppendWrite();
-    WriteReg16(FT_REG_CMD_WRITE, g_Inst.cmdQueueWriteIndex);
+    EndAppend();
+    PublishCommands();
     WaitForQueueEmpty();
+
+    // CMD_CALIBRATE puts its own display lists on the screen, and
+    // FTGLSwapBuffers is never called for the frame begun above
+    FTGLInvalidateFrame();
+    g_Inst.inFrame = 0;
+#if FTGL_DEFERRED_DRAWS > 0
+    g_Inst.deferring = 0;
+#endif
 }
 
 // Load the 6 touch transform register values into the given array
@@ -100,11 +100,49 @@ extern "C" {
 
 // TODO(eric): Calculate ram usage from defines and fail if too large
 #define FTGL_MAX_BITMAPS                FTGL_CONFIG_MAX_BITMAPS
+#define FTGL_MAX_SEGMENTS               FTGL_CONFIG_MAX_SEGMENTS
 #define FTGL_CACHE_GRAPHICS_CONTEXT     FTGL_CONFIG_CACHE_GRAPHICS_CONTEXT
 #define FTGL_CACHE_BITMAP_HANDLES       FTGL_CONFIG_CACHE_BITMAP_HANDLES
 #define FTGL_CACHE_COMMAND_CONTEXT      FTGL_CONFIG_CACHE_COMMAND_CONTEXT
 #define FTGL_CONTEXT_STACK_DEPTH        FTGL_CONFIG_CONTEXT_STACK_DEPTH      
+#define FTGL_MATRIX_STACK_DEPTH         FTGL_CONFIG_MATRIX_STACK_DEPTH
+#define FTGL_CLIP_STACK_DEPTH           FTGL_CONFIG_CLIP_STACK_DEPTH
+#define FTGL_COMMAND_STACK_DEPTH        FTGL_CONFIG_COMMAND_STACK_DEPTH
 #define FTGL_DEFAULT_SENSITIVITY        FTGL_CONFIG_DEFAULT_SENSITIVITY
+#define FTGL_WRITE_BUFFER_SIZE          FTGL_CONFIG_USE_WRITE_BUFFER
+#define FTGL_ASYNC_TRANSFER             FTGL_CONFIG_ASYNC_TRANSFER
+#define FTGL_USE_INTERRUPTS             FTGL_CONFIG_USE_INTERRUPTS
+#define FTGL_SNAPSHOT_REGISTERS         FTGL_CONFIG_SNAPSHOT_REGISTERS
+#define FTGL_KICK_THRESHOLD             FTGL_CONFIG_KICK_THRESHOLD
+#define FTGL_FRAME_ELISION              FTGL_CONFIG_FRAME_ELISION
+#define FTGL_DEFERRED_DRAWS             FTGL_CONFIG_DEFERRED_DRAWS
+#define FTGL_DEFERRED_TEXT_SIZE         FTGL_CONFIG_DEFERRED_TEXT_SIZE
+#define FTGL_USE_SIMD                   FTGL_CONFIG_USE_SIMD
+
+#if FTGL_ASYNC_TRANSFER == 1 && FTGL_WRITE_BUFFER_SIZE == 0
+#error "FTGL_CONFIG_ASYNC_TRANSFER requires FTGL_CONFIG_USE_WRITE_BUFFER"
+#endif
+
+
+#if FTGL_SNAPSHOT_REGISTERS < 2
+#error "FTGL_CONFIG_SNAPSHOT_REGISTERS must be at least 2"
+#endif
+
+#if FTGL_DEFERRED_DRAWS > 32
+#error "FTGL_CONFIG_DEFERRED_DRAWS can be at most 32"
+#endif
+
+#if FTGL_DEFERRED_DRAWS > 0 && (FTGL_CACHE_GRAPHICS_CONTEXT == 0 || FTGL_CACHE_COMMAND_CONTEXT == 0)
+#error "FTGL_CONFIG_DEFERRED_DRAWS requires the graphics and command context caches"
+#endif
+
+#if FTGL_CONTEXT_STACK_DEPTH > 15
+#error "FTGL_CONFIG_CONTEXT_STACK_DEPTH can be at most 15"
+#endif
+
+#if FTGL_COMMAND_STACK_DEPTH > 0 && FTGL_CACHE_COMMAND_CONTEXT == 0
+#error "FTGL_CONFIG_COMMAND_STACK_DEPTH requires FTGL_CONFIG_CACHE_COMMAND_CONTEXT"
+#endif
 
 #if FTGL_CONFIG_DISPLAY_TYPE == FTGL_DISPLAY_WQVGA
     #define FT_DISPLAY_VSYNC0 				FT_DISPLAY_VSYNC0_WQVGA 
@@ -201,6 +239,15 @@ void FTGLBeginBuffer(void);
  */
 void FTGLSwapBuffers(void);
 
+/**
+ * With FTGL_CONFIG_FRAME_ELISION, a frame that is identical to the one on
+ * the screen is not sent. FTGL cannot see changes made to RAM_G or the
+ * registers behind its back, so call this after making one that changes
+ * how the next frame looks. FTGL's own RAM_G and palette functions already
+ * call it.
+ */
+void FTGLInvalidateFrame(void);
+
 /**
  * Returns true if there is currently a touch.
  *
@@ -237,6 +284,36 @@ int FTGLTouchY(void);
  */
 int FTGLTouchTag(void);
 
+/**
+ * Adds a 32 bit register (FT_REG_*) to the set of registers that are read
+ * at the end of every frame, together with the touch registers. Registers
+ * that are close together are read in one transfer.
+ *
+ * Returns a slot number to pass to FTGLSnapshotValue, or -1 if the address
+ * is not 4 byte aligned or FTGL_CONFIG_SNAPSHOT_REGISTERS are already in use.
+ * Adding a register that is already in the set returns its existing slot.
+ */
+int FTGLSnapshotRegister(uint32_t reg);
+
+/**
+ * Returns the value a snapshot register had when the last frame finished.
+ * Updated at the same time as the touch information.
+ */
+uint32_t FTGLSnapshotValue(int slot);
+
+/**
+ * Waits until one of the FT800 interrupts in 'mask' (FT_INT_SWAP,
+ * FT_INT_CMDFLAG, etc) happens, or 'timeoutMS' milliseconds pass.
+ *
+ * Returns the interrupts from 'mask' that happened since they were last
+ * returned, 0 on timeout, or -1 if interrupts are not enabled
+ * (FTGL_CONFIG_USE_INTERRUPTS) or not supported by the platform. 
+ *
+ * Use this outside of FTGLBeginBuffer/FTGLSwapBuffers, for example to wait
+ * for a FTGLCmdInterrupt added to the previous frame.
+ */
+int FTGLWaitInterrupt(uint8_t mask, int timeoutMS);
+
 ////////////////////////////////////////////////////////
 // Display list commands (primitives and low level stuff)
 // Use these only between BeginBuffer and SwapBuffers
@@ -252,6 +329,12 @@ void FTGLVertex2ii(uint16_t x, uint16_t y, uint8_t handle, uint8_t cell); // Int
 void FTGLVertex2f(uint16_t x, uint16_t y); // 11.4 fixed point coordinate vertex (ie, if you want 35.5, use (int)(16*35.5))
 void FTGLEnd(void); // Ends a vertex list
 
+// Adds count vertices at once, taking the coordinates from the x and y
+// arrays. This is the same as calling FTGLVertex2f or FTGLVertex2ii for each
+// one, but much faster for long lists such as graphs.
+void FTGLVertex2fArray(const uint16_t *x, const uint16_t *y, uint16_t count);
+void FTGLVertex2iiArray(const uint16_t *x, const uint16_t *y, uint8_t handle, uint8_t cell, uint16_t count);
+
 //// Bitmaps:
 // Set the current bitmap handle. All bitmap config commands will now effect this handle.
 // Any Vertex2f calls will implicitly use this handle
@@ -268,6 +351,12 @@ void FTGLBitmapCell(uint8_t cell); // Select the current cell number. Used impli
 */
 // Used to apply scaling, rotation, shearing, etc
 // All values are 8.8 signed fixed point (17 bits total)
+// With FTGL_CONFIG_CACHE_GRAPHICS_CONTEXT, these are only sent when the next
+// command is, and only if they differ from the values already in effect, so
+// setting a transform and setting it back afterwards is cheap when the next
+// draw uses the same one. FTGLCmdSetMatrix writes all six values from the
+// coprocessor matrix, so they are only known after it if the matrix was last
+// reset with FTGLCmdLoadIdentity.
 void FTGLBitmapTransformA(uint32_t a);
 void FTGLBitmapTransformB(uint32_t b);
 void FTGLBitmapTransformC(uint32_t c);
@@ -275,6 +364,34 @@ void FTGLBitmapTransformD(uint32_t d);
 void FTGLBitmapTransformE(uint32_t e);
 void FTGLBitmapTransformF(uint32_t f);
 
+//// Host matrix
+// These work like FTGLCmdLoadIdentity, FTGLCmdTranslate, FTGLCmdScale,
+// FTGLCmdRotate and FTGLCmdSetMatrix, but the matrix is kept and computed by
+// FTGL instead of the coprocessor, in 16.16 fixed point, so nothing is sent
+// until FTGLSetMatrix. FTGLSetMatrix then writes the bitmap transform
+// directly, and only the values that changed are sent.
+//
+// Ex. Rotating a 64x64 icon around its center
+// FTGLLoadIdentity();
+// FTGLTranslate(32 * 65536L, 32 * 65536L);
+// FTGLRotate(angle);
+// FTGLTranslate(-32 * 65536L, -32 * 65536L);
+// FTGLSetMatrix();
+// FTGLCmdBitmap(icon, x, y);
+//
+// The host matrix and the coprocessor matrix are separate. Angles are in
+// units of 1/65536 of a clockwise turn, like FTGLCmdRotate.
+void FTGLLoadIdentity(void);
+void FTGLTranslate(int32_t tx, int32_t ty);
+void FTGLScale(int32_t sx, int32_t sy);
+void FTGLRotate(int32_t a);
+void FTGLSetMatrix(void);
+
+// Saves and restores the host matrix, up to FTGL_CONFIG_MATRIX_STACK_DEPTH
+// levels deep. Returns 0, or -1 if the stack is full or empty.
+int FTGLPushMatrix(void);
+int FTGLPopMatrix(void);
+
 //// FUNC and CLEAR values
 void FTGLAlphaFunc(uint8_t func, uint8_t refValue); // Set the function and threshold for the alpha test
 void FTGLBlendFunc(uint8_t src, uint8_t dst); // Same as openGL, by the way
@@ -304,6 +421,11 @@ void FTGLReturn(void); // returns from a procedure call
 void FTGLMacro(uint8_t m); // Run the command in macro register 0 or 1
 
 //// Context Saving
+// Saves and restores the graphics state (colors, scissor, stencil, bitmap
+// transform and the rest), but not the current BEGIN. With the graphics
+// context cache, saves are kept on the host (see
+// FTGL_CONFIG_CONTEXT_STACK_DEPTH) and restoring only sends the values that
+// changed, so these are cheap enough to wrap any panel or widget in.
 void FTGLSaveContext(void);
 void FTGLRestoreContext(void);
 
@@ -314,6 +436,27 @@ void FTGLPointSize(uint32_t size); // Set the radius of FT_POINTS primitives. 13
 // SCISSOR, STENCIL, TAG
 void FTGLScissorSize(uint16_t width, uint16_t height); // Sets the size of the scissor rect
 void FTGLScissorXY(uint16_t x, uint16_t y); // Set the (x, y) coord of the top left corner of the scissor rect
+
+// Clip stack. FTGLPushClip limits drawing to the part of the given rectangle
+// that is inside the current clip, and FTGLPopClip goes back to the clip
+// before it. The scissor is only sent when the clipped area changes. While a
+// clip is pushed, anything drawn at a known position and size (bitmaps and
+// every widget with x, y and a size, radius or ROM font) that is entirely
+// outside of it is not sent at all. Gradients fill the whole clip, and the
+// size of text in a custom font is not known, so those are always sent.
+//
+// Ex. A scrolling list
+// FTGLPushClip(panelX, panelY, panelW, panelH);
+// for (i = 0; i < count; i++) {
+//     FTGLCmdText(panelX, panelY + i * 20 - scroll, 26, 0, items[i], strlen(items[i]) + 1);
+// }
+// FTGLPopClip();
+//
+// Every push needs a pop before FTGLSwapBuffers. Do not change the scissor
+// directly while a clip is pushed. Up to FTGL_CONFIG_CLIP_STACK_DEPTH clips
+// can be pushed. Both return 0, or -1 if the stack is full or empty.
+int FTGLPushClip(int16_t x, int16_t y, int16_t w, int16_t h);
+int FTGLPopClip(void);
 void FTGLStencilFunc(uint8_t func, uint8_t ref, uint8_t mask); // Set the function, reference level and mask of the stencil
 void FTGLStencilOp(uint8_t sfail, uint8_t spass); // Choose the opration performed on the stencil buffer when the test fails or passes
 void FTGLTag(uint8_t tag); // Set the tag value for all the following drawing
@@ -326,6 +469,18 @@ void FTGLTagMask(uint8_t on); // Turn on or off writing to the tag buffer
 void FTGLCmdDLStart(void); // Starts a display list. NOT NEEDED. BeginBuffer does this for you
 void FTGLCmdSwap(void); // Ends the display list and displays it. NOT NEEDED. SwapBuffers does this for you
 void FTGLCmdColdStart(void); // Restores coprocessor state to defaults
+
+// Saves the coprocessor colors (FGColor, BGColor and GradColor) and whether
+// the coprocessor matrix is the identity, and restores them. Restoring only
+// sends the colors that changed since the save, so this is much cheaper
+// than FTGLCmdColdStart for undoing a temporary color change, and it keeps
+// any other coprocessor state. A matrix that was not the identity when it
+// was saved can not be restored.
+//
+// Up to FTGL_CONFIG_COMMAND_STACK_DEPTH levels can be saved. Both return 0,
+// or -1 if the stack is full or empty.
+int FTGLPushCommandContext(void);
+int FTGLPopCommandContext(void);
 void FTGLCmdInflate(uint32_t ptr, uint8_t *data, uint32_t count); // decompress deflate archive into memory at ptr
 void FTGLCmdLoadImage(uint32_t ptr, uint32_t options, uint8_t *data, uint32_t count); // decompress a jpeg into memory at ptr. 
 void FTGLCmdButton(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t font, uint16_t options, const char *str, uint16_t len); // Draw a button
@@ -357,6 +512,7 @@ void FTGLCmdSetFont(uint32_t font, uint32_t ptr);
 void FTGLCmdTrack(int16_t x, int16_t y, int16_t w, int16_t h, int16_t tag);
 void FTGLCmdSnapshot(uint32_t ptr);
 void FTGLCmdLogo(void);
+void FTGLCmdInterrupt(uint32_t ms); // Raises FT_INT_CMDFLAG after waiting ms milliseconds. See FTGLWaitInterrupt
 
 ////////////////////////////////////////////////////////////////////
 // Bitmap handling
@@ -385,9 +541,15 @@ void FTGLCmdLogo(void);
 
 // Creates a bitmap with the given parameters and allocates space for it 
 // in the RAM_G area of the FT800. Returns the bitmap id, used to refer to the
-// bitmap in other functions.
+// bitmap in other functions, or -1 if FTGL_CONFIG_MAX_BITMAPS bitmaps already
+// exist or there is no free block of RAM_G large enough.
 int FTGLCreateBitmap(uint8_t format, int widthInPixels, int heightInLines);
 
+// Frees the bitmap's id and RAM_G space for other bitmaps. Do not destroy a
+// bitmap that is drawn by the frame on screen or by a recorded segment.
+// Ids that are out of range or not allocated, such as -1, are ignored.
+void FTGLDestroyBitmap(int bitmapId);
+
 // These can be used to change the parameters of a bitmap.
 // This will invalidate any bitmap handle that currently has this image
 // loaded, forcing the bitmap to be reloaded.
@@ -424,6 +586,28 @@ int8_t FTGLUseBitmap(int bitmapId);
 // are later calls to CmdBitmap/UseBitmap, so use this as soon as you
 // get it and then don't use it again.
 int8_t FTGLGetEmptyHandle(void);
+
+// When every handle is in use, the least recently used bitmap is evicted to
+// make room. Pinning a bitmap keeps it in its handle once it has been loaded,
+// so that bitmaps drawn on every frame (icons, custom fonts) are not reloaded
+// when a screen draws more bitmaps than there are handles. At most
+// FTGL_NUM_BITMAP_HANDLES - 1 bitmaps can be pinned at once.
+//
+// Returns 0, or -1 if too many bitmaps are already pinned.
+int FTGLPinBitmap(int bitmapId);
+void FTGLUnpinBitmap(int bitmapId);
+
+// Counts of how bitmap draws found their handles during the current frame,
+// or the last frame if called between frames. If evictions happen every
+// frame, the screen uses more bitmaps than there are handles, and the
+// bitmaps it draws most should be pinned.
+typedef struct {
+    uint16_t hits;      // The bitmap was already loaded into a handle
+    uint16_t misses;    // The bitmap had to be loaded into a handle
+    uint16_t evictions; // Loading it replaced another bitmap
+} FTGLBitmapHandleStats;
+
+void FTGLGetBitmapHandleStats(FTGLBitmapHandleStats *stats);
 #endif
 
 // Lower level command to load a bitmap into a manually selected handle
@@ -434,6 +618,180 @@ void FTGLDrawBitmapInHandle(int8_t handle, int x, int y, int cell);
 
 void FTGLGetBitmapSize(int bitmapId, int *width, int *height);
 
+////////////////////////////////////////////////////////////////////
+// Recorded segments
+//
+// Parts of a screen that look the same every frame can be recorded once and
+// then replayed in later frames, instead of sending all of their commands
+// again. A recording is the display list the coprocessor produced for the
+// commands between FTGLBeginRecord and FTGLEndRecord. FTGLEndRecord copies
+// it into RAM_G, and FTGLReplay adds it to the current display list with a
+// single CMD_APPEND.
+//
+// Ex.
+// int background = FTGLCreateSegment();
+// ...
+// FTGLBeginBuffer();
+// if (!FTGLSegmentRecorded(background)) {
+//     FTGLBeginRecord(background);
+//     ... draw the background ...
+//     FTGLEndRecord();
+// } else {
+//     FTGLReplay(background);
+// }
+// ... draw everything else ...
+// FTGLSwapBuffers();
+//
+// A recording starts from an unknown graphics state, so it sets every value it
+// depends on itself, and loads any bitmaps it draws into handles. Replaying
+// it leaves the graphics state and bitmap handles unknown, so FTGL sets them
+// again as needed afterwards. Recordings store the RAM_G addresses of the
+// bitmaps they draw, so bitmap data must not move while they are in use.
+//
+// Beginning and ending a recording each wait for the command queue to empty,
+// so recording is slower than drawing normally. Use these between
+// FTGLBeginBuffer and FTGLSwapBuffers.
+
+// Returns a new segment id, or -1 if FTGL_CONFIG_MAX_SEGMENTS are in use.
+// The functions below ignore ids that were not returned by this, so -1 can
+// be passed through safely.
+int FTGLCreateSegment(void);
+
+// Starts recording into the given segment, replacing any earlier
+// recording. Recordings can not be nested.
+void FTGLBeginRecord(int segmentId);
+
+// Ends the recording and copies it into RAM_G. Returns the size of the
+// recording in bytes, or -1 if there was not enough RAM_G for it.
+int FTGLEndRecord(void);
+
+// Returns true if the segment holds a recording that can be replayed.
+int FTGLSegmentRecorded(int segmentId);
+
+// Adds the segment's recording to the current frame.
+void FTGLReplay(int segmentId);
+
+////////////////////////////////////////////////////////////////////
+// Layers
+//
+// A layer is a bitmap holding a picture of a part of the screen that is
+// expensive to draw but rarely changes, such as a gauge face made of many
+// overlapping widgets and gradients. It is drawn once with FTGLBeginLayer and
+// FTGLEndLayer, captured into RAM_G with CMD_SNAPSHOT, and from then on drawn
+// like any other bitmap, with a single vertex. Besides sending fewer
+// commands, this saves the FT800 from rendering every piece of it on every
+// line, which helps screens that are close to dropping scanlines.
+//
+// Ex.
+// int face = FTGLCreateLayer(200, 200);
+// ...
+// if (!FTGLLayerValid(face)) {
+//     FTGLBeginLayer(face);
+//     ... draw the gauge face, with (0, 0) at its top left ...
+//     FTGLEndLayer();
+// }
+// FTGLBeginBuffer();
+// FTGLCmdBitmap(face, 140, 36);
+// ... draw the needle ...
+// FTGLSwapBuffers();
+//
+// Layers are ARGB4 bitmaps, two bytes per pixel, so they take a lot of RAM_G
+// and have less color depth than the screen. Pixels not drawn in the layer
+// get the clear color, including its alpha.
+//
+// The FT800 can only snapshot the screen, so FTGLEndLayer puts the layer on
+// the screen and turns the display off while it is captured. Render layers
+// when the screen is changing anyways, such as when it is first shown, not
+// every few frames. FTGLEndLayer blocks until the snapshot is done. A layer
+// may draw bitmaps and replay segments, but not itself.
+
+// Returns the bitmap id of a new layer, or -1 if there is not enough RAM_G or
+// no free bitmap id. Width and height are at most 511. Destroy it with
+// FTGLDestroyBitmap.
+int FTGLCreateLayer(uint16_t width, uint16_t height);
+
+// Returns true if the layer holds a snapshot that is up to date
+int FTGLLayerValid(int layerId);
+
+// Marks the layer as needing to be drawn again, such as after what it shows
+// has changed
+void FTGLInvalidateLayer(int layerId);
+
+// Starts drawing the contents of a layer. Use this instead of FTGLBeginBuffer,
+// outside of a frame. Returns -1 if a frame or layer is already in progress.
+int FTGLBeginLayer(int layerId);
+
+// Finishes the layer and snapshots it into the layer's bitmap. Returns -1 if
+// no layer was begun, or if the layer's frame was not swapped onto the screen
+// in time to be captured. The layer stays invalid in that case.
+int FTGLEndLayer(void);
+
+////////////////////////////////////////////////////////////////////
+// Command stream optimizer
+//
+// Commands that are built once and sent many times (display lists kept in
+// flash, captured command streams, anything that is copied to RAM_G and
+// appended every frame) are worth making as small as possible first. Every
+// word removed from them is a word that no longer goes over the bus each
+// time they are used.
+//
+// FTGLOptimizeCommands rewrites a stream of display list and coprocessor
+// commands, in the little endian format FTGL sends them in, and removes:
+//  - State writes that set a value that is already in effect
+//  - State writes that are overwritten before anything draws with them,
+//    including repeated BITMAP_TRANSFORM_A-F settings
+//  - A BEGIN of the primitive that is already being drawn, along with the
+//    END before it, and a BEGIN that draws nothing
+//  - Points, bitmaps, lines and rectangles that are entirely outside of the
+//    scissor rectangle, when the scissor and sizes are known
+//
+// The stream is assumed to start from an unknown graphics state, the way a
+// recording or an appended block does, unless it starts with CMD_DLSTART.
+// Coprocessor commands are kept, and the optimizer assumes nothing about the
+// state after one that adds to the display list. It stops at the first
+// command whose size it can not tell (CMD_INFLATE, CMD_LOADIMAGE) and leaves
+// the rest of the stream as it is.
+//
+// Optimizes count bytes at commands in place, and returns the new size.
+// count should be a multiple of 4. extras/optimizer_check.c checks that
+// optimized streams draw the same as the originals on the linux platform.
+uint32_t FTGLOptimizeCommands(uint8_t *commands, uint32_t count);
+
+////////////////////////////////////////////////////////////////////
+// Macros
+//
+// FTGLMacro(m) runs whatever display list command is in REG_MACRO_0 or
+// REG_MACRO_1 when the frame is rendered. Because the FT800 reads the
+// register every time it draws the frame, changing the register changes the
+// frame on screen without building or sending a new one. For blinking
+// indicators, cursors and scrolling this replaces a whole frame with a single
+// register write.
+//
+// Ex.
+// FTGLSetMacro(0, FT_COLOR_RGB(255, 0, 0));
+// FTGLBeginBuffer();
+// FTGLMacro(0);               // The color of the indicator
+// ... draw the indicator ...
+// FTGLSwapBuffers();
+// ...
+// FTGLSetMacro(0, FT_COLOR_RGB(0, 0, 0)); // Blink it off
+//
+// Outside of a frame, FTGLSetMacro writes the register immediately. During a
+// frame, the register is written once the frame has replaced the one on the
+// screen, so the frame currently on screen does not change until then. This
+// waits for the swap at the end of FTGLSwapBuffers (or, with
+// FTGL_CONFIG_ASYNC_TRANSFER, at the next FTGLBeginBuffer or FTGLSetMacro),
+// and the new frame is shown with the old value for up to one refresh. A
+// frame that only changed a macro value is still dropped by
+// FTGL_CONFIG_FRAME_ELISION, and the register is written right away. Writing
+// the value the register already holds does nothing.
+//
+// Since a macro may hold any command, FTGL does not know the graphics state
+// after FTGLMacro, and sets it again as needed.
+
+// Sets the display list command run by FTGLMacro(m)
+void FTGLSetMacro(uint8_t m, uint32_t dlCommand);
+
 /////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////
@@ -480,6 +838,102 @@ void FTGLSetTouchCalibrationParams(uint32_t params[6]);
 // 65535 is max sensisivity. Default is 1200
 void FTGLSetTouchSensitivity(uint16_t sens);
 
+////////////////////////////////////////////////////////
+//// RAM_G memory
+
+// Bitmaps and segment recordings are given the smallest free block of RAM_G
+// they fit in. After many bitmaps have been created and destroyed, the free
+// space may be split into blocks that are each too small for a new bitmap.
+// FTGLCompactMemory moves everything to the start of RAM_G using CMD_MEMCPY,
+// leaving a single free block, without uploading anything again.
+//
+// If any bitmap has to move, the screen is first swapped to a blank frame,
+// since the frame on screen reads bitmaps from their old addresses. It stays
+// blank until the next frame is drawn. Every segment recording is also
+// discarded, since they hold the old addresses. This blocks until the copies
+// are done.
+//
+// Call it outside of a frame (not between FTGLBeginBuffer and FTGLSwapBuffers,
+// or FTGLBeginLayer and FTGLEndLayer). Returns 0, or -1 without moving
+// anything if a frame is in progress or the screen could not be blanked.
+int FTGLCompactMemory(void);
+
+typedef struct {
+    uint32_t usedBytes;
+    uint32_t freeBytes;
+    uint32_t largestFreeBlock; // The largest bitmap that can be created
+    uint16_t blockCount;       // Number of allocated blocks
+    uint8_t fragmentation;     // Percent of free space not in the largest free block
+} FTGLMemoryInfo;
+
+void FTGLGetMemoryInfo(FTGLMemoryInfo *info);
+
+////////////////////////////////////////////////////////
+//// On-device memory operations
+
+// These run on the coprocessor, so only the command crosses the bus: clearing
+// a 64 KB bitmap is 12 bytes instead of 64 KB of FTGLBitmapBufferData.
+//
+// Unlike FTGLBitmapBufferData, they may be used inside or outside of a frame.
+// Inside a frame they run in order with the drawing commands, so a bitmap
+// cleared and then drawn shows up cleared. Outside of a frame they are sent
+// right away and block until the coprocessor has finished them.
+
+// Raw coprocessor commands. Addresses are FT800 addresses, such as
+// FT_RAM_G + offset. CMD_MEMCPY does not handle overlapping ranges.
+void FTGLCmdMemSet(uint32_t ptr, uint8_t value, uint32_t num);
+void FTGLCmdMemZero(uint32_t ptr, uint32_t num);
+void FTGLCmdMemCpy(uint32_t dest, uint32_t src, uint32_t num);
+void FTGLCmdMemWrite(uint32_t ptr, const uint8_t *data, uint32_t num);
+
+// Returns the CRC-32 of num bytes at ptr. This always blocks until the
+// coprocessor has caught up, so avoid it in the middle of a frame.
+uint32_t FTGLCmdMemCrc(uint32_t ptr, uint32_t num);
+
+// Return the results of the last CMD_INFLATE or CMD_LOADIMAGE: the address
+// just past the data it wrote, and for an image, its width and height (either
+// may be NULL). Like FTGLCmdMemCrc, these block.
+uint32_t FTGLCmdGetPtr(void);
+uint32_t FTGLCmdGetProps(uint32_t *width, uint32_t *height);
+
+// Fills buffer with up to count bytes of a payload, and returns how many it
+// wrote, or 0 at the end of the data.
+typedef uint16_t (*FTGLReader)(void *context, uint8_t *buffer, uint16_t count);
+
+// Streaming versions of FTGLCmdInflate, FTGLCmdLoadImage and FTGLCmdMemWrite,
+// for payloads that are not in memory all at once, such as assets read from
+// an SD card or flash. The reader is called for a small piece at a time,
+// which is sent while the coprocessor decodes the pieces before it, so
+// payloads of any size go through the 4 KB command queue. Storing assets
+// deflated or as JPEGs and decoding them on the FT800 sends several times
+// fewer bytes than uploading the pixels.
+//
+// FTGLCmdInflateStream returns the address just past the inflated data, and
+// FTGLCmdLoadImageStream returns the same for the decoded image and its
+// size. Both block until the coprocessor is done. FTGLCmdLoadImageStream
+// sets the image up in the current bitmap handle, as CMD_LOADIMAGE does.
+//
+// FTGLCmdMemWriteStream writes num bytes and returns how many the reader
+// gave. If the reader ends early, the rest are written as zeros.
+uint32_t FTGLCmdInflateStream(uint32_t ptr, FTGLReader reader, void *context);
+uint32_t FTGLCmdLoadImageStream(uint32_t ptr, uint32_t options, FTGLReader reader, void *context,
+    uint32_t *width, uint32_t *height);
+uint32_t FTGLCmdMemWriteStream(uint32_t ptr, uint32_t num, FTGLReader reader, void *context);
+
+// Sets every byte of a bitmap to 0
+void FTGLClearBitmap(int bitmapId);
+
+// Copies the data of srcId over destId. If they differ in size, only the
+// size of the smaller one is copied.
+void FTGLCopyBitmap(int destId, int srcId);
+
+// Sets every byte of the pixels in the rectangle to value, one CMD_MEMSET per
+// row (or one for the whole rectangle when it spans full rows). The fill
+// works in bytes: for L1 and L4 the rectangle is widened to whole bytes, and
+// for 16 bit formats only colors whose two bytes match, such as 0x0000 and
+// 0xFFFF, can be filled. The rectangle is clipped to the bitmap's layout.
+void FTGLFillBitmapRect(int bitmapId, int x, int y, int w, int h, uint8_t value);
+
 #ifdef __cplusplus
 }
 #endif
@@ -64,22 +64,119 @@ SOFTWARE.
 #define FTGL_CONFIG_CACHE_BITMAP_HANDLES 1
 
 
+// The size, in bytes, of a buffer on the microcontroller used to collect
+// commands before they are sent to the FT800. When enabled, commands are
+// copied into this buffer and sent in one bulk write when it fills up, when
+// FTGL has to wait for the command queue, and at FTGLSwapBuffers. This
+// greatly reduces the number of calls into the platform layer, since a
+// single command like FTGLCmdButton is otherwise written in many small
+// pieces. Set it to zero to write every piece of a command directly.
+#define FTGL_CONFIG_USE_WRITE_BUFFER 64
+
+// When enabled, the write buffer is sent with the platform's asynchronous
+// write calls (FTHWSubmitWrite, see fthw.h), and a second write buffer is
+// used so that FTGL can fill one while the platform sends the other, for
+// example with DMA. FTGLSwapBuffers submits the frame and returns without
+// waiting for it to be sent and drawn; that wait happens in the next
+// FTGLBeginBuffer instead, leaving the time in between to the application.
+// Because of this, the touch information is read when the previous frame
+// finishes, at the start of FTGLBeginBuffer.
+//
+// Requires FTGL_CONFIG_USE_WRITE_BUFFER, and doubles the RAM it uses.
+#define FTGL_CONFIG_ASYNC_TRANSFER 0
+
+// When enabled, and the platform reports that the FT800's interrupt pin is
+// connected (FTHWInterruptAvailable, see fthw.h), FTGL sleeps on the
+// interrupt pin while it waits for the command queue to empty, instead of
+// reading REG_CMD_READ over and over. This keeps the SPI bus free for other
+// devices and lets the platform sleep. It also makes FTGLWaitInterrupt
+// available to the application.
+#define FTGL_CONFIG_USE_INTERRUPTS 1
+
+// Once this many bytes of commands have been written without updating
+// REG_CMD_WRITE, FTGL updates it before the next command, so the
+// coprocessor can start working while the rest of the frame is written.
+// Each update costs a register write (and ends the current append write).
+// Set it to zero to only update REG_CMD_WRITE when the queue is full and at
+// FTGLSwapBuffers.
+#define FTGL_CONFIG_KICK_THRESHOLD 1024
+
+// When enabled, FTGL keeps a CRC of every command appended to a frame, and
+// does not publish the frame to REG_CMD_WRITE until FTGLSwapBuffers. If the
+// CRC matches the frame on the screen, the frame is taken back out of the
+// command queue, and FTGLSwapBuffers only updates the touch information. The
+// coprocessor never sees the frame, and whatever part of it was still in the
+// write buffer never goes over the bus. A frame that does not fit in the free
+// part of the command queue, or that waits on the coprocessor (such as a
+// recording), is published early and always sent.
+#define FTGL_CONFIG_FRAME_ELISION 0
+
+// The number of registers that can be read at the end of every frame (see
+// FTGLSnapshotRegister). FTGL uses two of them for the touch information.
+// Registers that are close together are read in a single transfer, which is
+// much cheaper than reading each one on its own.
+#define FTGL_CONFIG_SNAPSHOT_REGISTERS 6
+
 // The depth of the context stack. It is possible to use the SaveContext and
 // RestoreContext commands to save and restore the FT800 state from a stack.
 // If you are using graphics content caching, then the context data structure
 // has to know the maximum depth of SaveContexts you will perform, so it can
 // allocate a stack of contexts that is the appropriate size.
 //
+// Saves that fit in this stack are done on the host, and restoring only
+// sends the values that changed since the save, instead of SAVE_CONTEXT and
+// RESTORE_CONTEXT. Deeper saves still work, but use the FT800's own stack,
+// and the cache forgets everything when they are restored. Each level takes
+// about 100 bytes of RAM. At most 15.
+//
 // If FTGL_CONFIG_CACHE_GRAPHICS_CONTEXT is disabled, this option is ignored,
 // since the graphics context is not cached.
 //
 // If you do not expect to use SaveContext/RestoreContext, this can be safely
 // set to 0.
-#define FTGL_CONFIG_CONTEXT_STACK_DEPTH 0
+#define FTGL_CONFIG_CONTEXT_STACK_DEPTH 2
+
+// The depth of the coprocessor color stack (see FTGLPushCommandContext).
+// Each level takes 16 bytes of RAM. This requires
+// FTGL_CONFIG_CACHE_COMMAND_CONTEXT, and can be set to 0 without it.
+#define FTGL_CONFIG_COMMAND_STACK_DEPTH 2
+
+// The depth of the clip stack (see FTGLPushClip). Each level takes 8 bytes
+// of RAM.
+#define FTGL_CONFIG_CLIP_STACK_DEPTH 4
+
+// The depth of the host matrix stack (see FTGLPushMatrix). Each level takes
+// 24 bytes of RAM.
+#define FTGL_CONFIG_MATRIX_STACK_DEPTH 2
 
 // The number of bitmap objects to create. 
 #define FTGL_CONFIG_MAX_BITMAPS 16
 
+// The number of recorded display list segments (see FTGLBeginRecord) that
+// can exist at once. Each one keeps its recording in RAM_G.
+#define FTGL_CONFIG_MAX_SEGMENTS 8
+
+// If > 0, bitmaps, text, numbers and buttons drawn during a frame are held
+// back (up to this many at a time, at most 32) and sorted before they are
+// sent, so that draws with the same color, tag and coprocessor colors end up
+// next to each other and fewer state changes are sent. A draw is never moved
+// past another draw that it overlaps, so the frame looks the same. Anything
+// else drawn sends the held draws first.
+//
+// Each held draw takes about 40 bytes of RAM, so this is off by default.
+// It requires FTGL_CONFIG_CACHE_GRAPHICS_CONTEXT and
+// FTGL_CONFIG_CACHE_COMMAND_CONTEXT.
+#define FTGL_CONFIG_DEFERRED_DRAWS 0
+
+// Bytes of RAM used to hold the strings of deferred text and buttons. When
+// it is full, the held draws are sent.
+#define FTGL_CONFIG_DEFERRED_TEXT_SIZE 256
+
+// If 1, FTGLVertex2fArray and FTGLVertex2iiArray pack vertices with SSE2 or
+// NEON instructions when the compiler targets a host that has them. Set to 0
+// to always use the portable code.
+#define FTGL_CONFIG_USE_SIMD 1
+
 // This is the maximum amount of RAM that you want to use. If this is enabled
 // (ie, > 0),  and the options above require more than the amount defined
 // here, FTGL produce a build error informing you that the settings exceed
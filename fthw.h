@@ -46,6 +46,8 @@ SOFTWARE.
 
 #if defined(ARDUINO)
 #include "fthw_platform_arduino.h"
+#elif defined(__linux__)
+#include "fthw_platform_linux.h"
 #else
 #error "Include your platform header here"
 #endif
@@ -135,6 +137,68 @@ int FTHWBeginAppendWrite(uint32_t writeAddress);
 int FTHWAppendWrite(const uint8_t *data, uint16_t count);
 int FTHWEndAppendWrite(void);
 
+/**
+ * Vectored writes. These take an array of segments that are written one
+ * after the other, as if they were one contiguous buffer. FTHWWritev is a
+ * single write transaction to writeAddress, and FTHWAppendWritev continues
+ * the current append write (see above).
+ *
+ * FTGL uses these to send a command's header, its string or data payload,
+ * and the alignment padding without copying them together first. A platform
+ * should send all of the segments within one CS low period (or one DMA
+ * descriptor chain). Both return the total number of bytes written.
+ */
+typedef struct {
+    const uint8_t *data;
+    uint16_t count;
+} FTHWSegment;
+
+int FTHWWritev(uint32_t writeAddress, const FTHWSegment *segments, uint8_t segmentCount);
+int FTHWAppendWritev(const FTHWSegment *segments, uint8_t segmentCount);
+
+/**
+ * Asynchronous writes. These are only used when FTGL_CONFIG_ASYNC_TRANSFER
+ * is enabled.
+ *
+ * FTHWSubmitWrite starts a write of 'count' bytes from 'data' to
+ * 'writeAddress' (the same transfer FTHWWrite performs), but may return
+ * before the transfer is finished, for example by handing it to a DMA
+ * controller. The caller will not modify 'data' until the transfer is
+ * complete. Transfers must complete in the order they were submitted.
+ *
+ * FTHWSubmitWrite returns a ticket for the transfer, in the range [0,
+ * 0x7FFF]. Tickets count up by one per transfer and wrap around.
+ * FTHWPollWrite returns 1 if the transfer with the given ticket is done (and
+ * so, every transfer submitted before it), or 0 if it is still in flight.
+ * FTHWCompleteWrite blocks until it is done.
+ *
+ * Every other FTHW call that uses the bus must wait for the transfers in
+ * flight to finish before it starts.
+ *
+ * A platform with no way to transfer in the background can perform the
+ * write inside FTHWSubmitWrite and always report it as complete.
+ */
+#define FTHW_TICKET_MASK 0x7FFF
+int FTHWSubmitWrite(uint32_t writeAddress, const uint8_t *data, uint16_t count);
+int FTHWPollWrite(int ticket);
+int FTHWCompleteWrite(int ticket);
+
+/**
+ * Interrupt support, used to wait for the FT800 without polling its registers
+ * over the bus.
+ *
+ * FTHWInterruptAvailable returns 1 if the FT800's INT_N pin is connected and
+ * FTHWWaitInterrupt can be used, or 0 if it is not.
+ *
+ * FTHWWaitInterrupt blocks until INT_N is asserted or 'timeoutMS'
+ * milliseconds have passed, and returns 1 if it is asserted or 0 on timeout.
+ * INT_N stays asserted until REG_INT_FLAGS is read, so an interrupt that
+ * happened before the call makes it return immediately. The platform is free
+ * to sleep or run other tasks while it waits.
+ */
+int FTHWInterruptAvailable(void);
+int FTHWWaitInterrupt(int timeoutMS);
+
 /**
  * Performs a Host Command.
  *
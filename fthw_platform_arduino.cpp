@@ -51,6 +51,7 @@ SPISettings fastSettings(30000000, MSBFIRST, SPI_MODE0);
 SPISettings slowSettings(100000, MSBFIRST, SPI_MODE0);
 SPISettings currentSettings(30000000, MSBFIRST, SPI_MODE0);
 uint32_t appendCount = 0;
+int submitTicket = 0;
 
 int FTHWInitialize(void) {
     pinMode(SLAVE_SELECT_PIN, OUTPUT);
@@ -173,6 +174,48 @@ int FTHWEndAppendWrite(void) {
     return appendCount;
 }
 
+int FTHWWritev(uint32_t writeAddress, const FTHWSegment *segments, uint8_t segmentCount) {
+    int total;
+    FTHWBeginAppendWrite(writeAddress);
+    total = FTHWAppendWritev(segments, segmentCount);
+    FTHWEndAppendWrite();
+    return total;
+}
+
+int FTHWAppendWritev(const FTHWSegment *segments, uint8_t segmentCount) {
+    uint8_t i;
+    int total = 0;
+    for (i = 0; i < segmentCount; i++) {
+        total += FTHWAppendWrite(segments[i].data, segments[i].count);
+    }
+    return total;
+}
+
+// The SPI library has no way to transfer in the background, so async
+// writes are performed immediately.
+int FTHWSubmitWrite(uint32_t writeAddress, const uint8_t *data, uint16_t count) {
+    FTHWWrite(writeAddress, data, count);
+    submitTicket = (submitTicket + 1) & FTHW_TICKET_MASK;
+    return submitTicket;
+}
+
+int FTHWPollWrite(int ticket) { return 1; }
+int FTHWCompleteWrite(int ticket) { return 0; }
+
+int FTHWInterruptAvailable(void) { return 1; }
+
+int FTHWWaitInterrupt(int timeoutMS) {
+    unsigned long start = millis();
+    // INT_N is active low
+    while (digitalRead(INTERRUPT_PIN) == HIGH) {
+        if ((long)(millis() - start) >= timeoutMS) {
+            return 0;
+        }
+        yield();
+    }
+    return 1;
+}
+
 int FTHWHostCommand(uint8_t commandId) {
     digitalWrite(SLAVE_SELECT_PIN, LOW);
     SPI.beginTransaction(currentSettings);
@@ -0,0 +1,748 @@
+/*
+Copyright 2016 Stepper 3 LLC
+Copyright 2016 Eric Alzheimer
+
+Licensed under the GNU GPL version 3.0 license:
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <https://www.gnu.org/licenses/>.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/************************************************************
+ * fthw_platform_linux.c
+ * --------------------------------------------------------
+ *  An implementation of the ftui platform layer (fthw.h) that
+ *  emulates the FT800 memory map on a linux host. See
+ *  fthw_platform_linux.h for the extra calls used to configure
+ *  the cost model and read back the bus statistics.
+ *
+ *  The emulated coprocessor does not render anything. It advances
+ *  REG_CMD_READ towards REG_CMD_WRITE, either instantly or at the rate
+ *  given in the cost model, so that FTGL's queue handling behaves as it
+ *  would on the real chip. The words it consumes are parsed just far
+ *  enough to copy display list commands to RAM_DL and advance
+ *  REG_CMD_DL, and to run CMD_APPEND and CMD_MEMCPY, so that recorded
+ *  segments have their real size and content.
+ *
+ *  Asynchronous writes are handed to a worker thread, which plays the
+ *  part of a DMA controller. Every other call waits for the worker to
+ *  go idle before touching the emulated chip, just like a shared bus.
+ ***********************************************************/
+#define _POSIX_C_SOURCE 200112L
+#include "fthw.h"
+#include "FT800.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#define REG_BLOCK_START FT_REG_ID
+#define REG_BLOCK_SIZE  0x200
+#define TRACKER_SIZE    4
+
+#define ASYNC_QUEUE_SIZE 4
+
+// The number of display list words a drawing widget is assumed to
+// produce. The real count depends on the widget's size and options.
+#define WIDGET_DL_WORDS  8
+#define CMD_NUM_SIZES    0x35
+
+#define STARTUP_BYTES_PER_SECOND (4000000 / 8)
+#define RUN_BYTES_PER_SECOND     (30000000 / 8)
+
+typedef struct {
+    uint32_t base;
+    uint32_t size;
+    uint8_t *memory;
+} MemoryRegion;
+
+static uint8_t s_RamG[FT_RAM_G_SIZE];
+static uint8_t s_RamDL[FT_RAM_DL_SIZE];
+static uint8_t s_RamPal[FT_RAM_PAL_SIZE];
+static uint8_t s_Regs[REG_BLOCK_SIZE];
+static uint8_t s_RamCmd[FT_CMDFIFO_SIZE];
+static uint8_t s_Tracker[TRACKER_SIZE];
+
+static const MemoryRegion s_Regions[] = {
+    { FT_RAM_G,       FT_RAM_G_SIZE,   s_RamG },
+    { FT_RAM_DL,      FT_RAM_DL_SIZE,  s_RamDL },
+    { FT_RAM_PAL,     FT_RAM_PAL_SIZE, s_RamPal },
+    { REG_BLOCK_START, REG_BLOCK_SIZE, s_Regs },
+    { FT_RAM_CMD,     FT_CMDFIFO_SIZE, s_RamCmd },
+    { FT_REG_TRACKER, TRACKER_SIZE,    s_Tracker },
+};
+#define NUM_REGIONS (sizeof(s_Regions) / sizeof(s_Regions[0]))
+
+static FTHWLinuxCostModel s_Model = {
+    STARTUP_BYTES_PER_SECOND,
+    RUN_BYTES_PER_SECOND,
+    1000,
+    0,
+    0
+};
+
+static FTHWLinuxStats s_Stats;
+static uint32_t s_BytesPerSecond = STARTUP_BYTES_PER_SECOND;
+
+// Modeled time, advanced only by bus activity. Unlike the stats, this is
+// never reset, since the coprocessor model is measured against it.
+static uint64_t s_NowNS;
+static uint64_t s_CoprocessorNS;
+
+static int s_AppendActive;
+static uint32_t s_AppendAddress;
+
+// The coprocessor command being parsed. Commands can be split across
+// several runs of the coprocessor, so this survives between them.
+typedef struct {
+    uint8_t cmd;
+    uint8_t paramCount;
+    uint8_t paramsLeft;   // Parameter words still to come
+    uint8_t inString;     // Skipping a string up to its terminator
+    uint8_t inStream;     // Skipping compressed data of unknown length
+    uint32_t payloadLeft; // MEMWRITE data bytes still to come
+    uint32_t params[3];
+} CommandParser;
+
+static CommandParser s_Parser;
+
+static int32_t s_TickOffsetMS;
+static struct timespec s_StartTime;
+
+typedef struct {
+    uint32_t address;
+    const uint8_t *data;
+    uint16_t count;
+} AsyncWrite;
+
+// Writes waiting for (or being performed by) the worker thread. Entries
+// from s_AsyncHead up to s_AsyncTail are in flight.
+static AsyncWrite s_AsyncQueue[ASYNC_QUEUE_SIZE];
+static unsigned s_AsyncHead, s_AsyncTail;
+static uint16_t s_SubmittedTicket, s_CompletedTicket;
+static int s_AsyncStarted;
+static pthread_t s_AsyncThread;
+static pthread_mutex_t s_AsyncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_AsyncCond = PTHREAD_COND_INITIALIZER;
+
+//////////////////////////////////////////////////////
+// Emulated memory
+
+static const MemoryRegion *FindRegion(uint32_t addr) {
+    unsigned i;
+    for (i = 0; i < NUM_REGIONS; i++) {
+        if (addr >= s_Regions[i].base && addr < s_Regions[i].base + s_Regions[i].size) {
+            return &s_Regions[i];
+        }
+    }
+    return NULL;
+}
+
+static uint32_t GetReg(uint32_t reg) {
+    uint32_t val;
+    memcpy(&val, &s_Regs[reg - REG_BLOCK_START], sizeof(val));
+    return FT_TO_HOST_ULONG(val);
+}
+
+static void SetReg(uint32_t reg, uint32_t val) {
+    val = HOST_TO_FT_ULONG(val);
+    memcpy(&s_Regs[reg - REG_BLOCK_START], &val, sizeof(val));
+}
+
+// Returns the emulated memory backing [addr, addr + count), or NULL if the
+// range is not entirely inside one region.
+static uint8_t *RangeMemory(uint32_t addr, uint32_t count) {
+    const MemoryRegion *region = FindRegion(addr);
+    if (region == NULL || count > region->base + region->size - addr) { return NULL; }
+    return region->memory + (addr - region->base);
+}
+
+static int Touches(uint32_t addr, uint32_t count, uint32_t reg) {
+    return addr < reg + 4 && reg < addr + count;
+}
+
+static void PowerOnReset(void) {
+    memset(s_RamG, 0, sizeof(s_RamG));
+    memset(s_RamDL, 0, sizeof(s_RamDL));
+    memset(s_RamPal, 0, sizeof(s_RamPal));
+    memset(s_Regs, 0, sizeof(s_Regs));
+    memset(s_RamCmd, 0, sizeof(s_RamCmd));
+    memset(s_Tracker, 0, sizeof(s_Tracker));
+    memset(&s_Parser, 0, sizeof(s_Parser));
+    SetReg(FT_REG_ID, 0x7C);
+    SetReg(FT_REG_TOUCH_SCREEN_XY, 0x80008000UL);
+    SetReg(FT_REG_TOUCH_TAG_XY, 0x80008000UL);
+    SetReg(FT_REG_TOUCH_RZTHRESH, 0xFFFF);
+    SetReg(FT_REG_INT_MASK, 0xFF);
+    s_CoprocessorNS = s_NowNS;
+}
+
+//////////////////////////////////////////////////////
+// Coprocessor and bus models
+
+static void AddBusTime(uint32_t transactions, uint32_t bytes) {
+    uint64_t ns = (uint64_t)transactions * s_Model.transactionOverheadNS;
+    ns += ((uint64_t)bytes * 1000000000ULL) / s_BytesPerSecond;
+    s_Stats.transactions += transactions;
+    s_Stats.bytes += bytes;
+    s_Stats.busTimeNS += ns;
+    s_NowNS += ns;
+}
+
+// Size in bytes of each coprocessor command and its parameters, indexed by
+// the low byte. Zero means the size is not known.
+static const uint8_t s_CommandSizes[CMD_NUM_SIZES] = {
+    4,  4,  8,  0,  0,  0,  0,  0,  0,  8,  8, 20, 12, 16, 16, 20, // 00-0F
+    20, 20, 16, 20, 20, 8, 12,  4, 16, 12, 12, 16, 12, 16, 12,  8, // 10-1F
+    56, 56,  8,  8, 12, 16,  4, 12, 12,  8,  4, 12, 16, 16, 16,  4, // 20-2F
+    20, 4,  4, 28,  8                                              // 30-34
+};
+
+// Appends display list bytes at REG_CMD_DL. Passing NULL appends
+// placeholder NOPs instead.
+static void DisplayListAppend(const uint8_t *data, uint32_t count) {
+    uint32_t offset = GetReg(FT_REG_CMD_DL);
+    if (count > FT_RAM_DL_SIZE - offset) { count = FT_RAM_DL_SIZE - offset; }
+    if (data != NULL) {
+        memmove(&s_RamDL[offset], data, count);
+    } else {
+        uint32_t nop = HOST_TO_FT_ULONG(0x2D000000UL), i;
+        for (i = 0; i + 4 <= count; i += 4) { memcpy(&s_RamDL[offset + i], &nop, 4); }
+    }
+    SetReg(FT_REG_CMD_DL, offset + count);
+}
+
+static int IsWidget(uint8_t cmd) {
+    switch (cmd) {
+    case FT_CMD_GRADIENT & 0xFF: case FT_CMD_TEXT & 0xFF:
+    case FT_CMD_BUTTON & 0xFF: case FT_CMD_KEYS & 0xFF:
+    case FT_CMD_PROGRESS & 0xFF: case FT_CMD_SLIDER & 0xFF:
+    case FT_CMD_SCROLLBAR & 0xFF: case FT_CMD_TOGGLE & 0xFF:
+    case FT_CMD_GAUGE & 0xFF: case FT_CMD_CLOCK & 0xFF:
+    case FT_CMD_DIAL & 0xFF: case FT_CMD_NUMBER & 0xFF:
+    case FT_CMD_SPINNER & 0xFF:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Applies a command once all of its parameters have arrived
+static void ExecuteCommand(void) {
+    uint8_t cmd = s_Parser.cmd;
+    uint32_t *p = s_Parser.params;
+
+    if (IsWidget(cmd)) {
+        DisplayListAppend(NULL, WIDGET_DL_WORDS * 4);
+    }
+
+    switch (cmd) {
+    case FT_CMD_DLSTART & 0xFF:
+        SetReg(FT_REG_CMD_DL, 0);
+        break;
+    case FT_CMD_TEXT & 0xFF: case FT_CMD_BUTTON & 0xFF:
+    case FT_CMD_KEYS & 0xFF: case FT_CMD_TOGGLE & 0xFF:
+        s_Parser.inString = 1;
+        break;
+    case FT_CMD_MEMWRITE & 0xFF:
+        s_Parser.payloadLeft = (p[1] + 3) & ~3UL;
+        break;
+    case FT_CMD_INFLATE & 0xFF: case FT_CMD_LOADIMAGE & 0xFF:
+        s_Parser.inStream = 1;
+        break;
+    case FT_CMD_APPEND & 0xFF:
+        DisplayListAppend(RangeMemory(p[0], p[1]), p[1]);
+        break;
+    case FT_CMD_MEMCPY & 0xFF: {
+        uint8_t *dest = RangeMemory(p[0], p[2]);
+        uint8_t *src = RangeMemory(p[1], p[2]);
+        if (dest != NULL && src != NULL) { memmove(dest, src, p[2]); }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Feeds one consumed command word through the parser. This only models
+// what FTGL depends on: REG_CMD_DL advancing, CMD_APPEND and CMD_MEMCPY.
+static void ConsumeWord(uint32_t word) {
+    if (s_Parser.inStream) {
+        // The compressed data's length is not known, so resynchronize on
+        // the next CMD_DLSTART
+        if (word != FT_CMD_DLSTART) { return; }
+        s_Parser.inStream = 0;
+    } else if (s_Parser.paramsLeft > 0) {
+        if (s_Parser.paramCount < 3) { s_Parser.params[s_Parser.paramCount] = word; }
+        s_Parser.paramCount++;
+        if (--s_Parser.paramsLeft == 0) { ExecuteCommand(); }
+        return;
+    } else if (s_Parser.payloadLeft > 0) {
+        s_Parser.payloadLeft -= 4;
+        return;
+    } else if (s_Parser.inString) {
+        if ((word & 0xFF) == 0 || (word & 0xFF00) == 0 ||
+            (word & 0xFF0000) == 0 || (word & 0xFF000000UL) == 0) {
+            s_Parser.inString = 0;
+        }
+        return;
+    }
+
+    if ((word & 0xFFFFFF00UL) != 0xFFFFFF00UL) {
+        uint32_t ftWord = HOST_TO_FT_ULONG(word);
+        DisplayListAppend((const uint8_t *)&ftWord, 4);
+        return;
+    }
+
+    s_Parser.cmd = (uint8_t)(word & 0xFF);
+    s_Parser.paramCount = 0;
+    if (s_Parser.cmd >= CMD_NUM_SIZES || s_CommandSizes[s_Parser.cmd] == 0) {
+        s_Parser.inStream = 1;
+        return;
+    }
+    s_Parser.paramsLeft = (uint8_t)(s_CommandSizes[s_Parser.cmd] / 4 - 1);
+    if (s_Parser.paramsLeft == 0) { ExecuteCommand(); }
+}
+
+// Moves REG_CMD_READ towards REG_CMD_WRITE by however many bytes the
+// coprocessor could have consumed since it was last run.
+static void RunCoprocessor(void) {
+    uint32_t readIndex = GetReg(FT_REG_CMD_READ) & 0xFFF;
+    uint32_t writeIndex = GetReg(FT_REG_CMD_WRITE) & 0xFFF;
+    uint32_t pending = (writeIndex - readIndex) & 0xFFF;
+    uint64_t consumed;
+    uint32_t i;
+
+    if (pending == 0) {
+        s_CoprocessorNS = s_NowNS;
+        return;
+    }
+
+    if (s_Model.coprocessorBytesPerSecond == 0) {
+        consumed = pending;
+    } else {
+        consumed = ((s_NowNS - s_CoprocessorNS) * s_Model.coprocessorBytesPerSecond) / 1000000000ULL;
+        consumed &= ~3ULL; // The coprocessor works on whole words
+        if (consumed > pending) { consumed = pending; }
+        s_CoprocessorNS += (consumed * 1000000000ULL) / s_Model.coprocessorBytesPerSecond;
+    }
+
+    for (i = 0; i + 4 <= consumed; i += 4) {
+        uint32_t word;
+        memcpy(&word, &s_RamCmd[(readIndex + i) & 0xFFF], sizeof(word));
+        ConsumeWord(FT_TO_HOST_ULONG(word));
+    }
+
+    SetReg(FT_REG_CMD_READ, (readIndex + (uint32_t)consumed) & 0xFFF);
+    if (consumed == pending) {
+        s_CoprocessorNS = s_NowNS;
+        SetReg(FT_REG_INT_FLAGS, GetReg(FT_REG_INT_FLAGS) | FT_INT_CMDEMPTY);
+    }
+}
+
+// The modeled time at which the coprocessor will have emptied the queue
+static uint64_t CoprocessorDoneNS(void) {
+    uint32_t readIndex = GetReg(FT_REG_CMD_READ) & 0xFFF;
+    uint32_t writeIndex = GetReg(FT_REG_CMD_WRITE) & 0xFFF;
+    uint32_t pending = (writeIndex - readIndex) & 0xFFF;
+    if (pending == 0 || s_Model.coprocessorBytesPerSecond == 0) {
+        return s_NowNS;
+    }
+    return s_CoprocessorNS + (pending * 1000000000ULL + s_Model.coprocessorBytesPerSecond - 1) /
+                             s_Model.coprocessorBytesPerSecond;
+}
+
+static int InterruptAsserted(void) {
+    return (GetReg(FT_REG_INT_EN) & 1) &&
+           (GetReg(FT_REG_INT_FLAGS) & GetReg(FT_REG_INT_MASK)) != 0;
+}
+
+// Applies the side effects of a host write to the register block
+static void RegistersWritten(uint32_t addr, uint32_t count) {
+    if (Touches(addr, count, FT_REG_CMD_WRITE)) {
+        RunCoprocessor();
+    }
+    if (Touches(addr, count, FT_REG_DLSWAP) && GetReg(FT_REG_DLSWAP) != FT_DLSWAP_DONE) {
+        // The swap happens instantly, there is no scanout to wait for
+        SetReg(FT_REG_DLSWAP, FT_DLSWAP_DONE);
+        SetReg(FT_REG_FRAMES, GetReg(FT_REG_FRAMES) + 1);
+        SetReg(FT_REG_INT_FLAGS, GetReg(FT_REG_INT_FLAGS) | FT_INT_SWAP);
+    }
+}
+
+static void MemoryWrite(uint32_t addr, const uint8_t *data, uint32_t count) {
+    while (count > 0) {
+        const MemoryRegion *region = FindRegion(addr);
+        uint32_t n = 1;
+        if (region != NULL) {
+            n = region->base + region->size - addr;
+            if (n > count) { n = count; }
+            memcpy(region->memory + (addr - region->base), data, n);
+            if (region->memory == s_Regs) {
+                RegistersWritten(addr, n);
+            }
+        }
+        // Writes to unmapped addresses are dropped, like the real chip
+        addr += n;
+        data += n;
+        count -= n;
+    }
+}
+
+static void MemoryRead(uint32_t addr, uint8_t *data, uint32_t count) {
+    while (count > 0) {
+        const MemoryRegion *region = FindRegion(addr);
+        uint32_t n = 1;
+        if (region != NULL) {
+            n = region->base + region->size - addr;
+            if (n > count) { n = count; }
+            if (region->memory == s_Regs &&
+                (Touches(addr, n, FT_REG_CMD_READ) || Touches(addr, n, FT_REG_INT_FLAGS))) {
+                RunCoprocessor();
+            }
+            memcpy(data, region->memory + (addr - region->base), n);
+            // Reading the interrupt flags clears them
+            if (region->memory == s_Regs && Touches(addr, n, FT_REG_INT_FLAGS)) {
+                SetReg(FT_REG_INT_FLAGS, 0);
+            }
+        } else {
+            *data = 0;
+        }
+        addr += n;
+        data += n;
+        count -= n;
+    }
+}
+
+//////////////////////////////////////////////////////
+// Asynchronous writes
+
+static void *AsyncWorker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&s_AsyncLock);
+    for (;;) {
+        AsyncWrite write;
+        uint64_t startNS, busNS;
+
+        while (s_AsyncHead == s_AsyncTail) {
+            pthread_cond_wait(&s_AsyncCond, &s_AsyncLock);
+        }
+        write = s_AsyncQueue[s_AsyncHead % ASYNC_QUEUE_SIZE];
+        pthread_mutex_unlock(&s_AsyncLock);
+
+        // Nothing else touches the emulated chip while a write is in flight
+        startNS = s_NowNS;
+        s_Stats.writes++;
+        s_Stats.payloadBytes += write.count;
+        AddBusTime(1, 3 + write.count);
+        MemoryWrite(write.address & 0x3FFFFF, write.data, write.count);
+        busNS = s_NowNS - startNS;
+
+        if (s_Model.sleepAsyncWrites) {
+            struct timespec delay;
+            delay.tv_sec = (time_t)(busNS / 1000000000ULL);
+            delay.tv_nsec = (long)(busNS % 1000000000ULL);
+            nanosleep(&delay, NULL);
+        }
+
+        pthread_mutex_lock(&s_AsyncLock);
+        s_AsyncHead++;
+        s_CompletedTicket = (s_CompletedTicket + 1) & FTHW_TICKET_MASK;
+        pthread_cond_broadcast(&s_AsyncCond);
+    }
+    return NULL;
+}
+
+// Tickets wrap around, so a ticket is done if it is not "ahead" of the
+// last completed one.
+static int TicketDone(int ticket) {
+    return ((s_CompletedTicket - ticket) & FTHW_TICKET_MASK) < (FTHW_TICKET_MASK / 2);
+}
+
+// Called at the start of every synchronous transfer (including each piece
+// of an append write), since the bus can only do one thing at a time. This
+// is also what keeps the worker thread and the caller from touching the
+// emulated chip and the stats at the same time.
+static void WaitBusIdle(void) {
+    if (!s_AsyncStarted) { return; }
+    pthread_mutex_lock(&s_AsyncLock);
+    while (s_AsyncHead != s_AsyncTail) {
+        pthread_cond_wait(&s_AsyncCond, &s_AsyncLock);
+    }
+    pthread_mutex_unlock(&s_AsyncLock);
+}
+
+int FTHWSubmitWrite(uint32_t writeAddress, const uint8_t *data, uint16_t count) {
+    AsyncWrite *write;
+    int ticket;
+
+    if (!s_AsyncStarted) {
+        if (pthread_create(&s_AsyncThread, NULL, AsyncWorker, NULL) != 0) {
+            return -1;
+        }
+        s_AsyncStarted = 1;
+    }
+
+    pthread_mutex_lock(&s_AsyncLock);
+    while (s_AsyncTail - s_AsyncHead == ASYNC_QUEUE_SIZE) {
+        pthread_cond_wait(&s_AsyncCond, &s_AsyncLock);
+    }
+    write = &s_AsyncQueue[s_AsyncTail % ASYNC_QUEUE_SIZE];
+    write->address = writeAddress;
+    write->data = data;
+    write->count = count;
+    s_AsyncTail++;
+    s_SubmittedTicket = (s_SubmittedTicket + 1) & FTHW_TICKET_MASK;
+    ticket = s_SubmittedTicket;
+    pthread_cond_broadcast(&s_AsyncCond);
+    pthread_mutex_unlock(&s_AsyncLock);
+
+    return ticket;
+}
+
+int FTHWPollWrite(int ticket) {
+    int done;
+    if (!s_AsyncStarted) { return 1; }
+    pthread_mutex_lock(&s_AsyncLock);
+    done = TicketDone(ticket);
+    pthread_mutex_unlock(&s_AsyncLock);
+    return done;
+}
+
+int FTHWCompleteWrite(int ticket) {
+    if (!s_AsyncStarted) { return 0; }
+    pthread_mutex_lock(&s_AsyncLock);
+    while (!TicketDone(ticket)) {
+        pthread_cond_wait(&s_AsyncCond, &s_AsyncLock);
+    }
+    pthread_mutex_unlock(&s_AsyncLock);
+    return 0;
+}
+
+//////////////////////////////////////////////////////
+// fthw.h implementation
+
+int FTHWInitialize(void) {
+    WaitBusIdle();
+    clock_gettime(CLOCK_MONOTONIC, &s_StartTime);
+    s_TickOffsetMS = 0;
+    s_AppendActive = 0;
+    s_BytesPerSecond = s_Model.startupBytesPerSecond;
+    memset(&s_Stats, 0, sizeof(s_Stats));
+    PowerOnReset();
+    return 0;
+}
+
+int FTHWSetSpeed(int speed) {
+    WaitBusIdle();
+    switch (speed) {
+        case FTHW_SPI_STARTUP_SPEED:
+            s_BytesPerSecond = s_Model.startupBytesPerSecond;
+            return FTHW_SPI_STARTUP_SPEED;
+        case FTHW_SPI_RUN_SPEED:
+            s_BytesPerSecond = s_Model.runBytesPerSecond;
+            return FTHW_SPI_RUN_SPEED;
+        default:
+            return -1;
+    }
+}
+
+int FTHWSetReset(int inReset) {
+    WaitBusIdle();
+    if (inReset) {
+        PowerOnReset();
+    }
+    return inReset;
+}
+
+int FTHWWrite(uint32_t writeAddress, const uint8_t *data, uint16_t count) {
+    WaitBusIdle();
+    s_Stats.writes++;
+    s_Stats.payloadBytes += count;
+    AddBusTime(1, 3 + count);
+    MemoryWrite(writeAddress & 0x3FFFFF, data, count);
+    return count;
+}
+
+int FTHWRead(uint32_t readAddress, uint8_t *data, uint16_t count) {
+    WaitBusIdle();
+    s_Stats.reads++;
+    s_Stats.payloadBytes += count;
+    AddBusTime(1, 4 + count); // Read requires a dummy byte
+    MemoryRead(readAddress & 0x3FFFFF, data, count);
+    return count;
+}
+
+int FTHWBeginAppendWrite(uint32_t writeAddress) {
+    WaitBusIdle();
+    s_Stats.writes++;
+    AddBusTime(1, 3);
+    s_AppendActive = 1;
+    s_AppendAddress = writeAddress & 0x3FFFFF;
+    return 0;
+}
+
+int FTHWAppendWrite(const uint8_t *data, uint16_t count) {
+    WaitBusIdle();
+    if (!s_AppendActive) { return -1; }
+    s_Stats.payloadBytes += count;
+    AddBusTime(0, count);
+    MemoryWrite(s_AppendAddress, data, count);
+    s_AppendAddress += count;
+    return count;
+}
+
+int FTHWEndAppendWrite(void) {
+    WaitBusIdle();
+    s_AppendActive = 0;
+    return 0;
+}
+
+int FTHWWritev(uint32_t writeAddress, const FTHWSegment *segments, uint8_t segmentCount) {
+    uint8_t i;
+    int total = 0;
+    WaitBusIdle();
+    for (i = 0; i < segmentCount; i++) {
+        MemoryWrite((writeAddress + total) & 0x3FFFFF, segments[i].data, segments[i].count);
+        total += segments[i].count;
+    }
+    s_Stats.writes++;
+    s_Stats.payloadBytes += total;
+    AddBusTime(1, 3 + total);
+    return total;
+}
+
+int FTHWAppendWritev(const FTHWSegment *segments, uint8_t segmentCount) {
+    uint8_t i;
+    int total = 0;
+    WaitBusIdle();
+    if (!s_AppendActive) { return -1; }
+    for (i = 0; i < segmentCount; i++) {
+        MemoryWrite(s_AppendAddress, segments[i].data, segments[i].count);
+        s_AppendAddress += segments[i].count;
+        total += segments[i].count;
+    }
+    s_Stats.payloadBytes += total;
+    AddBusTime(0, total);
+    return total;
+}
+
+int FTHWInterruptAvailable(void) { return 1; }
+
+// Waiting does not sleep. Instead, the modeled clock skips ahead to when the
+// coprocessor would have finished, or the tick count skips the whole timeout
+// the same way FTHWDelayMS does.
+int FTHWWaitInterrupt(int timeoutMS) {
+    uint64_t timeoutNS = (uint64_t)timeoutMS * 1000000ULL;
+    uint64_t doneNS;
+
+    WaitBusIdle();
+    s_Stats.interruptWaits++;
+    RunCoprocessor();
+    if (InterruptAsserted()) { return 1; }
+
+    doneNS = CoprocessorDoneNS();
+    if (doneNS > s_NowNS && doneNS - s_NowNS <= timeoutNS) {
+        s_NowNS = doneNS;
+    } else {
+        s_NowNS += timeoutNS;
+        s_TickOffsetMS += timeoutMS;
+    }
+    RunCoprocessor();
+    return InterruptAsserted();
+}
+
+int FTHWHostCommand(uint8_t commandId) {
+    WaitBusIdle();
+    s_Stats.hostCommands++;
+    AddBusTime(1, 3);
+    if (commandId == FT_HOSTCOMMAND_CORERST) {
+        PowerOnReset();
+    }
+    return 0;
+}
+
+// Delays do not sleep, so that initialization does not slow down
+// benchmark runs. They are added to the tick count instead, so timing
+// based code still sees them, and to the modeled clock, so the
+// coprocessor keeps working through them.
+void FTHWDelayMS(int x) {
+    WaitBusIdle();
+    s_TickOffsetMS += x;
+    s_NowNS += (uint64_t)x * 1000000ULL;
+}
+
+int32_t FTHWGetTicks(void) {
+    struct timespec now;
+    int64_t ms;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (int64_t)(now.tv_sec - s_StartTime.tv_sec) * 1000 +
+         (now.tv_nsec - s_StartTime.tv_nsec) / 1000000;
+    return (int32_t)ms + s_TickOffsetMS;
+}
+
+//////////////////////////////////////////////////////
+// Linux platform extras
+
+void FTHWLinuxSetCostModel(const FTHWLinuxCostModel *model) {
+    int running;
+    WaitBusIdle();
+    running = s_BytesPerSecond == s_Model.runBytesPerSecond;
+    RunCoprocessor();
+    s_Model = *model;
+    if (s_Model.startupBytesPerSecond == 0) { s_Model.startupBytesPerSecond = STARTUP_BYTES_PER_SECOND; }
+    if (s_Model.runBytesPerSecond == 0) { s_Model.runBytesPerSecond = RUN_BYTES_PER_SECOND; }
+    s_BytesPerSecond = running ? s_Model.runBytesPerSecond : s_Model.startupBytesPerSecond;
+}
+
+void FTHWLinuxGetCostModel(FTHWLinuxCostModel *model) { *model = s_Model; }
+
+void FTHWLinuxGetStats(FTHWLinuxStats *stats) {
+    WaitBusIdle();
+    *stats = s_Stats;
+}
+
+void FTHWLinuxResetStats(void) {
+    WaitBusIdle();
+    memset(&s_Stats, 0, sizeof(s_Stats));
+}
+
+void FTHWLinuxSetTouch(int x, int y, uint8_t tag) {
+    WaitBusIdle();
+    if (x < 0) {
+        SetReg(FT_REG_TOUCH_SCREEN_XY, 0x80008000UL);
+        SetReg(FT_REG_TOUCH_TAG_XY, 0x80008000UL);
+        SetReg(FT_REG_TOUCH_TAG, 0);
+    } else {
+        uint32_t xy = ((uint32_t)(x & 0xFFFF) << 16) | (uint32_t)(y & 0xFFFF);
+        SetReg(FT_REG_TOUCH_SCREEN_XY, xy);
+        SetReg(FT_REG_TOUCH_TAG_XY, xy);
+        SetReg(FT_REG_TOUCH_TAG, tag);
+    }
+}
+
+uint8_t *FTHWLinuxMemory(uint32_t address) {
+    const MemoryRegion *region;
+    WaitBusIdle();
+    region = FindRegion(address);
+    if (region == NULL) { return NULL; }
+    return region->memory + (address - region->base);
+}
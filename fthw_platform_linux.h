@@ -0,0 +1,144 @@
+/*
+Copyright 2016 Stepper 3 LLC
+Copyright 2016 Eric Alzheimer
+
+Licensed under the GNU GPL version 3.0 license:
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <https://www.gnu.org/licenses/>.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/************************************************************
+ * fthw_platform_linux.h
+ * --------------------------------------------------
+ *  Platform specific defines for a linux host.
+ *
+ *  There is no FT800 attached to a linux box, so this platform
+ *  emulates the FT800 memory map (RAM_G, RAM_DL, RAM_PAL, RAM_CMD and
+ *  the registers) in host memory. It does not render anything, but it
+ *  does count every SPI transaction and byte, and estimates how long
+ *  the bus would have been busy. This is used for measuring the cost
+ *  of FTGL/FTUI screens without a board.
+ ***********************************************************/
+#ifndef FTHW_PLATFORM_LINUX_H
+#define FTHW_PLATFORM_LINUX_H
+
+#include <stdint.h>
+
+/**
+ * These macros should convert the endianess of a word and dword to little
+ * endian, which is the expected output endianess for the ft800.
+ *
+ * If the platform is already little endian, these can do nothing
+ */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_TO_FT_SHORT(x) (x)
+#define HOST_TO_FT_LONG(x) (x)
+#define HOST_TO_FT_USHORT(x) (x)
+#define HOST_TO_FT_ULONG(x) (x)
+#else
+#define HOST_TO_FT_SHORT(x) ((int16_t)__builtin_bswap16((uint16_t)(x)))
+#define HOST_TO_FT_LONG(x) ((int32_t)__builtin_bswap32((uint32_t)(x)))
+#define HOST_TO_FT_USHORT(x) __builtin_bswap16(x)
+#define HOST_TO_FT_ULONG(x) __builtin_bswap32(x)
+#endif
+
+/**
+ * Simlarly, these should convert from the incoming little endian to the
+ * endianess of the host platform.
+ */
+#define FT_TO_HOST_SHORT(x) HOST_TO_FT_SHORT(x)
+#define FT_TO_HOST_LONG(x) HOST_TO_FT_LONG(x)
+#define FT_TO_HOST_USHORT(x) HOST_TO_FT_USHORT(x)
+#define FT_TO_HOST_ULONG(x) HOST_TO_FT_ULONG(x)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The cost model used to estimate SPI bus time.
+ *
+ * Every transaction (one CS low/high cycle) costs transactionOverheadNS,
+ * plus the time to clock out each of its bytes (including the address
+ * and dummy bytes) at the current speed. The startup speed is used until
+ * FTGL calls FTHWSetSpeed(FTHW_SPI_RUN_SPEED).
+ *
+ * coprocessorBytesPerSecond is how fast the emulated coprocessor consumes
+ * the command queue, measured against the modeled bus time. Zero means
+ * that commands are consumed as soon as REG_CMD_WRITE is written.
+ *
+ * Asynchronous writes (FTHWSubmitWrite) are performed by a worker thread.
+ * If sleepAsyncWrites is nonzero, the worker sleeps for the modeled bus
+ * time of each one, so that overlapping host work with transfers shows up
+ * in wall clock measurements.
+ *
+ * REG_INT_FLAGS is emulated for FT_INT_CMDEMPTY (when the coprocessor
+ * empties the queue) and FT_INT_SWAP (when REG_DLSWAP is written). The
+ * emulated coprocessor only executes CMD_DLSTART, CMD_APPEND and
+ * CMD_MEMCPY, so CMD_INTERRUPT never raises FT_INT_CMDFLAG. REG_CMD_DL
+ * advances by 4 for each display list command, and by an estimated 32
+ * bytes for each drawing widget (CMD_BUTTON, CMD_GAUGE, ...).
+ */
+typedef struct {
+    uint32_t startupBytesPerSecond;
+    uint32_t runBytesPerSecond;
+    uint32_t transactionOverheadNS;
+    uint32_t coprocessorBytesPerSecond;
+    uint32_t sleepAsyncWrites;
+} FTHWLinuxCostModel;
+
+/**
+ * Counters for everything that went over the emulated bus since
+ * initialization or the last call to FTHWLinuxResetStats.
+ */
+typedef struct {
+    uint32_t transactions; // Number of CS low/high cycles
+    uint32_t reads;
+    uint32_t writes;       // Includes append and asynchronous writes
+    uint32_t hostCommands;
+    uint32_t interruptWaits; // Calls to FTHWWaitInterrupt
+    uint32_t bytes;        // Every byte clocked, including address and dummy bytes
+    uint32_t payloadBytes; // Only the data bytes
+    uint64_t busTimeNS;    // Modeled time the bus was busy
+} FTHWLinuxStats;
+
+// Replace the cost model. The default models a 30 mhz run speed, a 4 mhz
+// startup speed, 1us of CS overhead and an instant coprocessor.
+void FTHWLinuxSetCostModel(const FTHWLinuxCostModel *model);
+void FTHWLinuxGetCostModel(FTHWLinuxCostModel *model);
+
+void FTHWLinuxGetStats(FTHWLinuxStats *stats);
+void FTHWLinuxResetStats(void);
+
+// Simulate a touch at (x, y) on the given tag. Pass a negative x to
+// simulate lifting the finger.
+void FTHWLinuxSetTouch(int x, int y, uint8_t tag);
+
+// Direct access to the emulated memory map, for inspecting what FTGL
+// wrote. Returns NULL if the address is not backed by emulated memory.
+uint8_t *FTHWLinuxMemory(uint32_t address);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -35,6 +35,13 @@ SOFTWARE.
 #include <avr/pgmspace.h>
 #endif
 
+typedef struct {
+    int16_t segment;    // FTGL segment holding the recording, or -1
+    uint8_t valid;      // The recording matches key
+    uint32_t key;       // Param of the last ON_CHANGE draw
+    int32_t drawnTicks; // When the region was last drawn
+} FTUIRegion;
+
 typedef struct {
     int8_t hadTouch;
     int8_t hasTouch;
@@ -55,6 +62,14 @@ typedef struct {
     // A font of the numbers 0-9 used to draw
     // FTUILargeNumber
     int numbersImage;
+
+    FTUIRegion regions[FTUI_MAX_REGIONS];
+    // The region being recorded by FTUIRegionBegin, or -1
+    int8_t recordingRegion;
+    // How many FTUIRegionBegins have not been ended yet, and how many
+    // there were when the recording began
+    uint8_t regionDepth;
+    uint8_t recordingDepth;
 } FTUIState;
 
 static FTUIState g_State;
@@ -64,6 +79,10 @@ static FTUIState g_State;
 void FTUIInitialize(void) {
     memset(&g_State, 0, sizeof(g_State));
     g_State.active = -1; 
+    g_State.recordingRegion = -1;
+    for (int i = 0; i < FTUI_MAX_REGIONS; i++) {
+        g_State.regions[i].segment = -1;
+    }
 
     FTGLInitialize();
 
@@ -112,7 +131,22 @@ int FTUIInRect(int x, int y, int w, int h) {
 
 void FTUIBegin(void) { FTGLBeginBuffer(); }
 
+// Ends the region being recorded, if any
+static void EndRecording(void) {
+    FTUIRegion *r;
+    if (g_State.recordingRegion < 0) { return; }
+    r = &g_State.regions[g_State.recordingRegion];
+    g_State.recordingRegion = -1;
+
+    // If the recording did not fit, the region was still drawn into this
+    // frame, and stays invalid so that it is drawn again next frame.
+    r->valid = FTGLEndRecord() > 0;
+}
+
 void FTUIEnd(void) { 
+    // In case a region was not ended
+    EndRecording();
+    g_State.regionDepth = 0;
     FTGLSwapBuffers(); 
     g_State.hadTouch = g_State.hasTouch;
     g_State.hasTouch = FTGLHasTouch();
@@ -301,9 +335,66 @@ void FTUILargeNumber(int x, int y, int numDigits, int scale, int leadingZeros, i
 }
 
 void FTUIBackgroundRect(int x, int y, int w, int h, uint32_t color) {
+    int saved = FTGLPushCommandContext() == 0;
     FTGLCmdFGColor(color);
     FTGLCmdButton(x, y, w, h, 31, /*FT_OPT_FLAT*/ 0, "", 1);
-    FTGLCmdColdStart();
+    if (saved) {
+        FTGLPopCommandContext();
+    } else {
+        FTGLCmdColdStart();
+    }
+}
+
+int FTUIRegionBegin(int region, int policy, uint32_t param) {
+    FTUIRegion *r;
+    int32_t now;
+
+    // Every begin is matched by an FTUIRegionEnd, even when it is not
+    // recorded
+    g_State.regionDepth++;
+    if (region < 0 || region >= FTUI_MAX_REGIONS) { return 1; }
+    r = &g_State.regions[region];
+
+    // A region inside of another is drawn as part of it
+    if (policy == FTUI_REFRESH_EVERY_FRAME || g_State.recordingRegion >= 0) {
+        return 1;
+    }
+
+    now = FTGLGetTicks();
+    if (r->valid && FTGLSegmentRecorded(r->segment)) {
+        if ((policy == FTUI_REFRESH_ON_CHANGE && param == r->key) ||
+            (policy == FTUI_REFRESH_PERIODIC && (uint32_t)(now - r->drawnTicks) < param)) {
+            FTGLReplay(r->segment);
+            return 0;
+        }
+    }
+
+    if (r->segment < 0) {
+        r->segment = (int16_t)FTGLCreateSegment();
+        if (r->segment < 0) { return 1; }
+    }
+
+    r->valid = 0;
+    r->key = param;
+    r->drawnTicks = now;
+    g_State.recordingRegion = (int8_t)region;
+    g_State.recordingDepth = g_State.regionDepth;
+    FTGLBeginRecord(r->segment);
+    return 1;
+}
+
+void FTUIRegionEnd(void) {
+    if (g_State.regionDepth == 0) { return; }
+    // Only the end that matches the recording's begin ends it
+    if (g_State.recordingRegion >= 0 && g_State.regionDepth == g_State.recordingDepth) {
+        EndRecording();
+    }
+    g_State.regionDepth--;
+}
+
+void FTUIInvalidateRegion(int region) {
+    if (region < 0 || region >= FTUI_MAX_REGIONS) { return; }
+    g_State.regions[region].valid = 0;
 }
 
 int32_t FTUIGetTicks(void) {
@@ -179,6 +179,15 @@ extern "C" {
 
 #define FTUI_USE_OPTIONS 1
 
+// The number of screen regions that can be used with FTUIRegionBegin. Each
+// one uses an FTGL segment, so this must not be more than
+// FTGL_CONFIG_MAX_SEGMENTS.
+#define FTUI_MAX_REGIONS 4
+
+#if FTUI_MAX_REGIONS > FTGL_MAX_SEGMENTS
+#error "FTUI_MAX_REGIONS must not be more than FTGL_CONFIG_MAX_SEGMENTS"
+#endif
+
 // TODO(eric): Give the fonts names
 ////////////////////////////////////////////////////
 
@@ -197,6 +206,51 @@ void FTUIBegin(void);
 // in between FTUIBegin and this.
 void FTUIEnd(void);
 
+// Regions
+//
+// A screen can be split into regions that are redrawn at different rates.
+// A region that does not need to be redrawn this frame is replayed from a
+// recording of the last time it was drawn (see FTGLBeginRecord), which costs
+// a single command instead of all of the region's commands.
+//
+// FTUIRegionBegin returns true when the region must be drawn. Either way,
+// end the region with FTUIRegionEnd:
+//
+// if (FTUIRegionBegin(REGION_STATUS, FTUI_REFRESH_ON_CHANGE, temperature)) {
+//     FTUIText(10, 10, 26, 0, "Temperature");
+//     FTUINumber(120, 10, 26, 0, temperature);
+// }
+// FTUIRegionEnd();
+//
+// The refresh policies are:
+//  FTUI_REFRESH_EVERY_FRAME - Always drawn, never recorded. param is unused.
+//  FTUI_REFRESH_ON_CHANGE   - Drawn when param differs from the last time it
+//                             was drawn. Pass a value (or hash) of everything
+//                             the region shows.
+//  FTUI_REFRESH_PERIODIC    - Drawn when at least param milliseconds have
+//                             passed since the last time it was drawn.
+//
+// Controls in a region that is replayed do not run, so they do not see
+// touches. Only put controls in a region if its key changes when they are
+// touched (FTUIGetActive() is a good thing to include), or use
+// FTUI_REFRESH_EVERY_FRAME for it.
+//
+// If a region can not be recorded (for example, RAM_G is full), it is drawn
+// every frame instead.
+#define FTUI_REFRESH_EVERY_FRAME 0
+#define FTUI_REFRESH_ON_CHANGE   1
+#define FTUI_REFRESH_PERIODIC    2
+
+// Region ids go from 0 to FTUI_MAX_REGIONS - 1. A region begun inside of
+// another one is drawn every frame, as part of the outer region. An id out
+// of range is drawn every frame, and still has to be ended.
+int FTUIRegionBegin(int region, int policy, uint32_t param);
+void FTUIRegionEnd(void);
+
+// Makes the region draw again the next time it is used, regardless of its
+// policy.
+void FTUIInvalidateRegion(int region);
+
 // A button drawn at the rectangle specified.
 // See the programmers manual for font ids (generally, bigger id is a larger
 // font). Draw the given text centered on the button.